@@ -16,11 +16,17 @@
 #include "actiondb.h"
 #include "main.h"
 #include "win.h"
+#include "pool.h"
+#include "actionfile.h"
+#include "saver.h"
 #include <glibmm/i18n.h>
+#include <sys/time.h>
+#include <limits.h>
 
 #include <iostream>
 #include <fstream>
 #include <string>
+#include <algorithm>
 #include <boost/archive/text_oarchive.hpp>
 #include <boost/archive/text_iarchive.hpp>
 #include <boost/serialization/map.hpp>
@@ -29,6 +35,7 @@
 #include <boost/serialization/vector.hpp>
 #include <boost/serialization/export.hpp>
 #include <boost/serialization/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
 
 BOOST_CLASS_EXPORT(StrokeSet)
 
@@ -118,6 +125,10 @@ template<class Archive> void StrokeInfo::serialize(Archive & ar, const unsigned
 
 using namespace std;
 
+static long usecs(const struct timeval &tv1, const struct timeval &tv2) {
+	return (tv2.tv_sec - tv1.tv_sec)*1000000 + tv2.tv_usec - tv1.tv_usec;
+}
+
 void Command::run() {
 	pid_t pid = fork();
 	switch (pid) {
@@ -181,6 +192,7 @@ template<class Archive> void ActionDB::load(Archive & ar, const unsigned int ver
 
 	root.fix_tree(version == 2);
 	root.add_apps(apps);
+	ActionListDiff::changed();
 	root.name = _("Default");
 }
 
@@ -190,45 +202,87 @@ template<class Archive> void ActionDB::save(Archive & ar, const unsigned int ver
 
 Source<bool> action_dummy;
 
+unsigned long ActionListDiff::generation = 1;
+ActionFile *ActionListDiff::journal = nullptr;
+
 void update_actions() {
+	ActionListDiff::changed();
 	action_dummy.set(false);
 }
 
 void ActionDBWatcher::init() {
 	std::string filename = config_dir+"actions";
+	file = new ActionFile(filename + actions_versions[0]);
 	for (const char **v = actions_versions; *v; v++)
 		if (is_file(filename + *v)) {
 			filename += *v;
 			try {
-				ifstream ifs(filename.c_str(), ios::binary);
-				if (!ifs.fail()) {
+				if (v == actions_versions && ActionFile::is_binary(filename)) {
+					file->load(actions);
+				} else {
+					ifstream ifs(filename.c_str(), ios::binary);
+					if (ifs.fail())
+						break;
 					boost::archive::text_iarchive ia(ifs);
 					ia >> actions;
-					if (verbosity >= 2)
-						printf("Loaded actions.\n");
+					// Older versions are converted the next time we save
+					notify();
 				}
+				if (verbosity >= 2)
+					printf("Loaded actions.\n");
 			} catch (exception &e) {
 				printf(_("Error: Couldn't read action database: %s.\n"), e.what());
 			}
 			break;
 		}
+	ActionListDiff::journal = file;
+	prepare_strokes();
 	watch(action_dummy);
 }
 
+// Loading only parses the strokes, which is what makes it fast, so finish
+// them in the background.  Strokes that are needed before that are finished
+// when they are first used.
+void ActionDBWatcher::prepare_strokes() {
+	boost::shared_ptr<std::list<RStroke> > strokes(new std::list<RStroke>);
+	actions.get_root()->all_strokes(*strokes);
+	for (std::list<RStroke>::iterator i = strokes->begin(); i != strokes->end();)
+		if (!*i || (*i)->ready())
+			i = strokes->erase(i);
+		else
+			i++;
+	if (strokes->empty())
+		return;
+	background.post([strokes]() {
+		struct timeval tv1, tv2;
+		gettimeofday(&tv1, 0);
+		std::vector<RStroke> todo(strokes->begin(), strokes->end());
+		WorkerPool workers;
+		workers.resize(std::thread::hardware_concurrency());
+		workers.run(todo.size(), [&](int i, int) { todo[i]->prepare(); });
+		gettimeofday(&tv2, 0);
+		if (verbosity >= 2)
+			printf("Prepared %lu strokes in %ld us\n", (unsigned long)todo.size(), usecs(tv1, tv2));
+	});
+}
+
 void ActionDBWatcher::timeout() {
-	std::string filename = config_dir+"actions"+actions_versions[0];
-	std::string tmp = filename + ".tmp";
-	try {
-		ofstream ofs(tmp.c_str());
-		boost::archive::text_oarchive oa(ofs);
-		oa << (const ActionDB &)actions;
-		ofs.close();
-		if (rename(tmp.c_str(), filename.c_str()))
-			throw std::runtime_error(_("rename() failed"));
+	// Get the indexes ready before the next gesture comes in
+	actions.get_root()->request_index();
+	for (std::map<std::string, ActionListDiff *>::iterator i = actions.apps.begin(); i != actions.apps.end(); i++)
+		i->second->request_index();
+	// Only the copying happens here, the writing is left to the saver, so
+	// that a slow disk doesn't hold up input handling.  Usually only the
+	// changes are appended to the journal.
+	bool full = file->needs_compaction();
+	std::function<void()> job = full ? file->save(actions) : file->flush();
+	saver.post([job, full]() {
+		job();
 		if (verbosity >= 2)
-			printf("Saved actions.\n");
-	} catch (exception &e) {
-		printf(_("Error: Couldn't save action database: %s.\n"), e.what());
+			printf(full ? "Saved actions.\n" : "Saved changes to the actions.\n");
+	}, [this](const std::string &what) {
+		file->set_compaction();
+		printf(_("Error: Couldn't save action database: %s.\n"), what.c_str());
 		if (!good_state)
 			return;
 		good_state = false;
@@ -236,44 +290,188 @@ void ActionDBWatcher::timeout() {
 				"Make sure that \"%2\" is a directory and that you have write access to it.  "
 				"You can change the configuration directory "
 				"using the -c or --config-dir command line options."), _("actions"), config_dir));
+	});
+}
+
+
+Unique *ActionListDiff::add(StrokeInfo &si, Unique *before) {
+	changed();
+	Unique *id = new Unique;
+	added.insert(std::pair<Unique *, StrokeInfo>(id, si));
+	id->level = level;
+	id->i = order.size();
+	if (before)
+		order.insert(std::find(order.begin(), order.end(), before), id);
+	else
+		order.push_back(id);
+	update_order();
+	if (journal)
+		journal->log_add(this, id, before, si);
+	return id;
+}
+
+void ActionListDiff::set_action(Unique *id, RAction action) {
+	changed();
+	added[id].action = action;
+	if (journal)
+		journal->log_set_action(this, id, action);
+}
+
+void ActionListDiff::set_strokes(Unique *id, StrokeSet strokes) {
+	changed();
+	added[id].strokes = strokes;
+	if (journal)
+		journal->log_set_strokes(this, id, strokes);
+}
+
+void ActionListDiff::set_name(Unique *id, std::string name) {
+	changed();
+	added[id].name = name;
+	if (journal)
+		journal->log_set_name(this, id, name);
+}
+
+void ActionListDiff::erase(Unique *id) {
+	added.erase(id);
+	order.remove(id);
+	update_order();
+	for (std::list<ActionListDiff>::iterator i = children.begin(); i != children.end(); i++)
+		i->erase(id);
+}
+
+bool ActionListDiff::remove(Unique *id) {
+	changed();
+	if (journal)
+		journal->log_remove(this, id);
+	bool really = !(parent && parent->contains(id));
+	if (really) {
+		added.erase(id);
+		order.remove(id);
+		update_order();
+	} else
+		deleted.insert(id);
+	for (std::list<ActionListDiff>::iterator i = children.begin(); i != children.end(); i++)
+		i->erase(id);
+	return really;
+}
+
+void ActionListDiff::reset(Unique *id) {
+	if (!parent)
+		return;
+	changed();
+	added.erase(id);
+	deleted.erase(id);
+	if (journal)
+		journal->log_reset(this, id);
+}
+
+ActionListDiff *ActionListDiff::add_child(std::string name, bool app) {
+	changed();
+	if (journal)
+		journal->log_add_list(this, name, app);
+	children.push_back(ActionListDiff());
+	ActionListDiff *child = &(children.back());
+	child->name = name;
+	child->app = app;
+	child->parent = this;
+	child->level = level + 1;
+	return child;
+}
+
+bool ActionListDiff::remove() {
+	if (!parent)
+		return false;
+	for (std::list<ActionListDiff>::iterator i = parent->children.begin(); i != parent->children.end(); i++) {
+		if (&*i == this) {
+			changed();
+			if (journal)
+				journal->log_remove_list(this);
+			parent->children.erase(i);
+			return true;
+		}
+
 	}
+	return false;
+}
+
+bool ActionListDiff::move(Unique *src, Unique *dest) {
+	if (!src)
+		return false;
+	if (src == dest)
+		return false;
+	if (parent && parent->contains(src))
+		return false;
+	if (dest && parent && parent->contains(dest))
+		return false;
+	if (!added.count(src))
+		return false;
+	if (dest && !added.count(dest))
+		return false;
+	changed();
+	order.remove(src);
+	order.insert(dest ? std::find(order.begin(), order.end(), dest) : order.end(), src);
+	update_order();
+	if (journal)
+		journal->log_move(this, src, dest);
+	return true;
 }
 
+void ActionListDiff::rename(std::string name_) {
+	changed();
+	name = name_;
+	if (journal)
+		journal->log_rename_list(this, name);
+}
+
+void ActionListDiff::resolve() const {
+	if (resolved_generation == generation)
+		return;
+	resolved.clear();
+	if (parent) {
+		parent->resolve();
+		resolved.reserve(parent->resolved.size() + added.size());
+		for (std::unordered_map<Unique *, Resolved>::const_iterator i = parent->resolved.begin(); i != parent->resolved.end(); i++)
+			resolved[i->first].info = i->second.info;
+	}
+	for (std::map<Unique *, StrokeInfo>::const_iterator i = added.begin(); i != added.end(); i++) {
+		Resolved &r = resolved[i->first];
+		StrokeInfo *si = r.info ? new StrokeInfo(*r.info) : new StrokeInfo;
+		if (i->second.name != "") {
+			si->name = i->second.name;
+			r.name = parent;
+		}
+		if (i->second.strokes.size()) {
+			si->strokes = i->second.strokes;
+			r.stroke = parent;
+		}
+		if (i->second.action) {
+			si->action = i->second.action;
+			r.action = parent;
+		}
+		r.info.reset(si);
+	}
+	for (std::set<Unique *>::const_iterator i = deleted.begin(); i != deleted.end(); i++) {
+		Resolved &r = resolved[*i];
+		if (!r.info)
+			r.info.reset(new StrokeInfo);
+		r.deleted = true;
+	}
+	resolved_generation = generation;
+}
 
 RStrokeInfo ActionListDiff::get_info(Unique *id, bool *deleted, bool *stroke, bool *name, bool *action) const {
+	resolve();
+	std::unordered_map<Unique *, Resolved>::const_iterator i = resolved.find(id);
+	const Resolved *r = i == resolved.end() ? nullptr : &i->second;
 	if (deleted)
-		*deleted = this->deleted.count(id);
+		*deleted = r && r->deleted;
 	if (stroke)
-		*stroke = false;
+		*stroke = r && r->stroke;
 	if (name)
-		*name = false;
+		*name = r && r->name;
 	if (action)
-		*action = false;
-	RStrokeInfo si = parent ? parent->get_info(id) : RStrokeInfo(new StrokeInfo);
-	std::map<Unique *, StrokeInfo>::const_iterator i = added.find(id);
-	for (i = added.begin(); i != added.end(); i++) {
-		if (i->first == id)
-			break;
-	}
-	if (i == added.end()) {
-		return si;
-	}
-	if (i->second.name != "") {
-		si->name = i->second.name;
-		if (name)
-			*name = parent;
-	}
-	if (i->second.strokes.size()) {
-		si->strokes = i->second.strokes;
-		if (stroke)
-			*stroke = parent;
-	}
-	if (i->second.action) {
-		si->action = i->second.action;
-		if (action)
-			*action = parent;
-	}
-	return si;
+		*action = r && r->action;
+	return r ? r->info : RStrokeInfo(new StrokeInfo);
 }
 
 boost::shared_ptr<std::map<Unique *, StrokeSet> > ActionListDiff::get_strokes() const {
@@ -298,40 +496,265 @@ boost::shared_ptr<std::set<Unique *> > ActionListDiff::get_ids(bool include_dele
 	return ids;
 }
 
-void ActionListDiff::all_strokes(std::list<RStroke> &strokes) const {
-	for (std::map<Unique *, StrokeInfo>::const_iterator i = added.begin(); i != added.end(); i++)
-		for (std::set<RStroke>::const_iterator j = i->second.strokes.begin(); j != i->second.strokes.end(); j++)
+void ActionListDiff::all_strokes(std::list<RStroke> &strokes, std::list<std::string> *names) const {
+	for (std::map<Unique *, StrokeInfo>::const_iterator i = added.begin(); i != added.end(); i++) {
+		std::string name = names ? get_info(i->first)->name : "";
+		for (std::set<RStroke>::const_iterator j = i->second.strokes.begin(); j != i->second.strokes.end(); j++) {
 			strokes.push_back(*j);
+			if (names)
+				names->push_back(name);
+		}
+	}
 	for (std::list<ActionListDiff>::const_iterator i = children.begin(); i != children.end(); i++)
-		i->all_strokes(strokes);
+		i->all_strokes(strokes, names);
 }
 
-RAction ActionListDiff::handle(RStroke s, RRanking &r) const {
-	if (!s)
-		return RAction();
+RTemplates ActionListDiff::get_templates() const {
+	if (templates && templates_generation == generation)
+		return templates;
+	Templates *ts = new Templates;
+	boost::shared_ptr<std::map<Unique *, StrokeSet> > strokes = get_strokes();
+	for (std::map<Unique *, StrokeSet>::const_iterator i = strokes->begin(); i!=strokes->end(); i++) {
+		RStrokeInfo si = get_info(i->first);
+		for (StrokeSet::const_iterator j = i->second.begin(); j!=i->second.end(); j++) {
+			Template t = { i->first, *j, si->action, si->name };
+			ts->push_back(t);
+		}
+	}
+	// Strokes that the background hasn't finished yet are finished here,
+	// several at a time.  A template may have no stroke at all.
+	std::vector<const Stroke *> todo;
+	for (Templates::const_iterator i = ts->begin(); i != ts->end(); i++)
+		if (i->stroke && !i->stroke->ready())
+			todo.push_back(i->stroke.get());
+	if (!todo.empty()) {
+		pool.resize(prefs.match_threads.get());
+		pool.run(todo.size(), [&](int i, int) { todo[i]->prepare(); });
+	}
+	// Templates without a stroke can't match, so they aren't in any bucket
+	std::vector<const stroke_t *> ss;
+	for (Templates::const_iterator i = ts->begin(); i != ts->end(); i++) {
+		if (i->stroke)
+			ts->buckets[template_key(*i->stroke)].push_back(ss.size());
+		ss.push_back(i->stroke ? i->stroke->get() : nullptr);
+	}
+	ts->pack = stroke_pack(ss.data(), ss.size());
+	templates.reset(ts);
+	templates_generation = generation;
+	return templates;
+}
+
+void Templates::find(const Stroke &s, bool any_button, std::vector<unsigned int> &is) const {
+	if (!any_button) {
+		std::map<TemplateKey, std::vector<unsigned int> >::const_iterator i = buckets.find(template_key(s));
+		if (i != buckets.end())
+			is.insert(is.end(), i->second.begin(), i->second.end());
+		return;
+	}
+	// The buckets that only differ in the button are next to each other
+	TemplateKey first(s.timeout, s.trigger, s.modifiers, s.timeout ? INT_MIN : 1);
+	TemplateKey last(s.timeout, s.trigger, s.modifiers, INT_MAX);
+	std::map<TemplateKey, std::vector<unsigned int> >::const_iterator end = buckets.upper_bound(last);
+	for (std::map<TemplateKey, std::vector<unsigned int> >::const_iterator i = buckets.lower_bound(first); i != end; i++)
+		is.insert(is.end(), i->second.begin(), i->second.end());
+}
+
+// Smaller lists aren't worth indexing
+static const unsigned int min_index_size = 64;
+
+void ActionListDiff::request_index() const {
+	if (!prefs.index_templates.get())
+		return;
+	RTemplates ts = get_templates();
+	if (ts->index_requested || ts->size() < min_index_size)
+		return;
+	ts->index_requested = true;
+	boost::weak_ptr<const Templates> weak = ts;
+	background.post([weak]() {
+		RTemplates ts = weak.lock();
+		// The list has changed again in the meantime
+		if (!ts)
+			return;
+		struct timeval tv1, tv2;
+		gettimeofday(&tv1, 0);
+		RClusterIndex index(new ClusterIndex(ts->pack, ts->size()));
+		gettimeofday(&tv2, 0);
+		if (verbosity >= 2)
+			printf("Indexed %lu templates in %d clusters, took %ld us\n",
+					(unsigned long)ts->size(), index->size(), usecs(tv1, tv2));
+		std::lock_guard<std::mutex> lock(ts->index_mutex);
+		ts->index = index;
+	});
+}
+
+// Skip the templates whose cluster is too far from s to contain a match, as
+// soon as the index is there.  Strokes that ended in a timeout have to match
+// more closely, so the cut-off of the other ones works for them too.  In
+// verbose mode, the result is checked against brute force once per index.
+static void prune(RStroke s, const Templates &ts, std::vector<bool> &skip) {
+	RClusterIndex index = ts.get_index();
+	if (!index || !s->get())
+		return;
+	static boost::shared_ptr<stroke_workspace_t> ws(stroke_workspace_alloc(), &stroke_workspace_free);
+	double max_cost = stroke_match_cost(false);
+	// The check costs as much as the lookups it saves, so it's only done
+	// for the first stroke that uses an index
+	bool check = verbosity >= 2 && !ts.index_checked;
+	std::vector<bool> before;
+	if (check) {
+		ts.index_checked = true;
+		before = skip;
+	}
+	struct timeval tv1, tv2, tv3, tv4;
+	gettimeofday(&tv1, 0);
+	int medoids = index->prune(ws.get(), s->get(), max_cost, skip);
+	if (!check)
+		return;
+	gettimeofday(&tv2, 0);
+	std::vector<const stroke_t *> all, kept;
+	std::vector<unsigned int> ids;
+	for (unsigned int i = 0; i < ts.size(); i++)
+		if (ts.pack[i] && !before[i]) {
+			all.push_back(ts.pack[i]);
+			ids.push_back(i);
+			if (!skip[i])
+				kept.push_back(ts.pack[i]);
+		}
+	std::vector<double> costs(all.size());
+	stroke_compare_many(ws.get(), s->get(), kept.data(), kept.size(), costs.data(), max_cost, STROKE_BOUND_FIXED);
+	gettimeofday(&tv3, 0);
+	stroke_compare_many(ws.get(), s->get(), all.data(), all.size(), costs.data(), max_cost, STROKE_BOUND_FIXED);
+	gettimeofday(&tv4, 0);
+	int relevant = 0, found = 0;
+	for (unsigned int k = 0; k < all.size(); k++)
+		if (costs[k] < max_cost) {
+			relevant++;
+			if (!skip[ids[k]])
+				found++;
+		}
+	long indexed = usecs(tv1, tv3), brute = usecs(tv3, tv4);
+	printf("Index: skipping %lu of %lu comparisons at the cost of %d, %.2f times as fast as brute force, "
+			"recall %d/%d\n", (unsigned long)(all.size() - kept.size()), (unsigned long)all.size(), medoids,
+			indexed ? (double)brute / indexed : 0.0, found, relevant);
+}
+
+// Rank the templates at the positions is by the distance of their
+// descriptors to s and mark all but the closest prefs.shortlist_size ones to
+// be skipped.
+static void shortlist(RStroke s, const std::vector<Template> &ts, const std::vector<unsigned int> &is, std::vector<bool> &skip) {
+	skip.assign(ts.size(), false);
+	unsigned int k = prefs.shortlist_size.get();
+	if (!k || !s->get())
+		return;
+	int type = prefs.shortlist_descriptor.get();
+	std::vector<std::pair<double, unsigned int> > ranking;
+	for (std::vector<unsigned int>::const_iterator i = is.begin(); i != is.end(); i++) {
+		const Stroke *t = ts[*i].stroke.get();
+		if (!t || !t->get())
+			continue;
+		ranking.push_back(std::make_pair(stroke_descriptor_distance(s->get(), t->get(), type), *i));
+	}
+	if (ranking.size() <= k)
+		return;
+	std::nth_element(ranking.begin(), ranking.begin() + k, ranking.end());
+	for (std::vector<std::pair<double, unsigned int> >::iterator i = ranking.begin() + k; i != ranking.end(); i++)
+		skip[i->second] = true;
+	if (verbosity >= 2)
+		printf("Shortlist: skipping %lu of %lu comparisons\n", (unsigned long)(ranking.size() - k), (unsigned long)ranking.size());
+}
+
+namespace {
+// A template that's going to be compared against the stroke being handled
+struct Candidate {
+	const Template *t;
+	const stroke_t *packed;
+	RStroke query;
+	int group; // candidates of the same group compete for the same ranking
+	double score;
+	int match;
+	Candidate(const Templates &ts, unsigned int i, RStroke query_, int group_) :
+		t(&ts[i]), packed(ts.pack[i]), query(query_), group(group_), score(0.0), match(-1) {}
+};
+}
+
+// Score all candidates on the worker pool.  The candidates are split into
+// chunks that don't depend on the scheduling, so the scores are the same no
+// matter how many threads there are.  Every candidate ends up in the
+// ranking, so comparisons are only cut short once they can't match at all,
+// never by the best score so far.  Runs of candidates with the same query
+// are compared in one go.
+static void compare_candidates(std::vector<Candidate> &cs) {
+	pool.resize(prefs.match_threads.get());
+	int n = cs.size();
+	int chunks = pool.size() == 1 ? 1 : std::min(n, 4 * pool.size());
+	std::vector<boost::shared_ptr<stroke_workspace_t> > ws;
+	for (int i = 0; i < pool.size(); i++)
+		ws.push_back(boost::shared_ptr<stroke_workspace_t>(stroke_workspace_alloc(), &stroke_workspace_free));
+	pool.run(chunks, [&](int chunk, int worker) {
+		std::vector<RStroke> bs;
+		std::vector<const stroke_t *> packed;
+		std::vector<double> scores;
+		std::vector<int> matches;
+		int end = (chunk + 1) * n / chunks;
+		for (int i = chunk * n / chunks, j; i < end; i = j) {
+			for (j = i; j < end && cs[j].query == cs[i].query; j++);
+			bs.clear();
+			packed.clear();
+			for (int k = i; k < j; k++) {
+				bs.push_back(cs[k].t->stroke);
+				packed.push_back(cs[k].packed);
+			}
+			scores.resize(j - i);
+			matches.resize(j - i);
+			Stroke::compare_many(cs[i].query, j - i, bs.data(), scores.data(), matches.data(),
+					ws[worker].get(), 0.0, false, packed.data());
+			for (int k = i; k < j; k++) {
+				cs[k].score = scores[k - i];
+				cs[k].match = matches[k - i];
+			}
+		}
+	});
+}
+
+void ActionListDiff::rank(RStroke s, RRanking &r) const {
 	r.reset(new Ranking);
 	r->stroke = s;
 	r->score = 0.0;
-	boost::shared_ptr<std::map<Unique *, StrokeSet> > strokes = get_strokes();
-	for (std::map<Unique *, StrokeSet>::const_iterator i = strokes->begin(); i!=strokes->end(); i++) {
-		for (StrokeSet::iterator j = i->second.begin(); j!=i->second.end(); j++) {
-			double score;
-			int match = Stroke::compare(s, *j, score);
-			if (match < 0)
-				continue;
-			RStrokeInfo si = get_info(i->first);
-			r->r.insert(pair<double, pair<std::string, RStroke> >
-					(score, pair<std::string, RStroke>(si->name, *j)));
-			if (score > r->score) {
-				r->score = score;
-				if (match) {
-					r->name = si->name;
-					r->action = si->action;
-					r->best_stroke = *j;
-				}
+	request_index();
+	RTemplates ts = get_templates();
+	// The other templates can't match anyway
+	std::vector<unsigned int> is;
+	ts->find(*s, false, is);
+	std::vector<bool> skip;
+	shortlist(s, *ts, is, skip);
+	prune(s, *ts, skip);
+	std::vector<Candidate> cs;
+	cs.reserve(is.size());
+	for (std::vector<unsigned int>::iterator i = is.begin(); i != is.end(); i++)
+		if (!skip[*i])
+			cs.push_back(Candidate(*ts, *i, s, 0));
+	compare_candidates(cs);
+	for (std::vector<Candidate>::iterator c = cs.begin(); c != cs.end(); c++) {
+		if (c->match < 0)
+			continue;
+		r->r.insert(pair<double, pair<std::string, RStroke> >
+				(c->score, pair<std::string, RStroke>(c->t->name, c->t->stroke)));
+		if (c->score > r->score) {
+			r->score = c->score;
+			if (c->match) {
+				r->name = c->t->name;
+				r->action = c->t->action;
+				r->best_stroke = c->t->stroke;
 			}
 		}
 	}
+}
+
+RAction ActionListDiff::handle(RStroke s, RRanking &r) const {
+	if (!s)
+		return RAction();
+	if (!r || r->stroke != s)
+		rank(s, r);
 	if (!r->action && s->trivial())
 		return RAction(new Click);
 	if (r->action) {
@@ -348,39 +771,57 @@ void ActionListDiff::handle_advanced(RStroke s, std::map<guint, RAction> &as,
 		std::map<guint, RRanking> &rs, int b1, int b2) const {
 	if (!s)
 		return;
-	boost::shared_ptr<std::map<Unique *, StrokeSet> > strokes = get_strokes();
-	for (std::map<Unique *, StrokeSet>::const_iterator i = strokes->begin(); i!=strokes->end(); i++) {
-		for (StrokeSet::iterator j = i->second.begin(); j!=i->second.end(); j++) {
-			int b = (*j)->button;
-			if (!s->timeout && !b)
-				continue;
-			s->button = b;
-			double score;
-			int match = Stroke::compare(s, *j, score);
-			if (match < 0)
-				continue;
-			Ranking *r;
-			if (b == b1)
-				b = b2;
-			if (rs.count(b)) {
-				r = rs[b].get();
-			} else {
-				r = new Ranking;
-				rs[b].reset(r);
-				r->stroke = RStroke(new Stroke(*s));
-				r->score = -1;
-			}
-			RStrokeInfo si = get_info(i->first);
-			r->r.insert(pair<double, pair<std::string, RStroke> >
-					(score, pair<std::string, RStroke>(si->name, *j)));
-			if (score > r->score) {
-				r->score = score;
-				if (match) {
-					r->name = si->name;
-					r->action = si->action;
-					r->best_stroke = *j;
-					as[b] = si->action;
-				}
+	request_index();
+	RTemplates ts = get_templates();
+	std::vector<unsigned int> is;
+	ts->find(*s, true, is);
+	std::vector<bool> skip;
+	shortlist(s, *ts, is, skip);
+	prune(s, *ts, skip);
+	// Compare against a copy of s for each button so that the workers don't
+	// have to modify s
+	std::map<int, RStroke> queries;
+	std::vector<Candidate> cs;
+	for (std::vector<unsigned int>::iterator i = is.begin(); i != is.end(); i++) {
+		if (skip[*i])
+			continue;
+		int b = (*ts)[*i].stroke->button;
+		RStroke &q = queries[b];
+		if (!q) {
+			q.reset(new Stroke(*s));
+			q->button = b;
+		}
+		cs.push_back(Candidate(*ts, *i, q, b == b1 ? b2 : b));
+	}
+	// Keep the candidates of each ranking together so that runs of the same
+	// query can be compared in one go.  Within a ranking, the templates stay
+	// in list order, which decides ties.
+	std::stable_sort(cs.begin(), cs.end(), [](const Candidate &x, const Candidate &y) {
+		return x.group < y.group;
+	});
+	compare_candidates(cs);
+	for (std::vector<Candidate>::iterator c = cs.begin(); c != cs.end(); c++) {
+		if (c->match < 0)
+			continue;
+		int b = c->group;
+		Ranking *r;
+		if (rs.count(b)) {
+			r = rs[b].get();
+		} else {
+			r = new Ranking;
+			rs[b].reset(r);
+			r->stroke = c->query;
+			r->score = -1;
+		}
+		r->r.insert(pair<double, pair<std::string, RStroke> >
+				(c->score, pair<std::string, RStroke>(c->t->name, c->t->stroke)));
+		if (c->score > r->score) {
+			r->score = c->score;
+			if (c->match) {
+				r->name = c->t->name;
+				r->action = c->t->action;
+				r->best_stroke = c->t->stroke;
+				as[b] = c->t->action;
 			}
 		}
 	}
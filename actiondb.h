@@ -18,13 +18,17 @@
 #include <string>
 #include <map>
 #include <set>
+#include <unordered_map>
+#include <tuple>
 #include <boost/serialization/access.hpp>
 #include <boost/serialization/version.hpp>
 #include <boost/serialization/split_member.hpp>
 #include <iostream>
+#include <mutex>
 
 #include "gesture.h"
 #include "prefdb.h"
+#include "cluster.h"
 
 class Action;
 class Command;
@@ -35,6 +39,7 @@ class Ignore;
 class Button;
 class Misc;
 class Ranking;
+class ActionFile;
 
 typedef boost::shared_ptr<Action> RAction;
 typedef boost::shared_ptr<Command> RCommand;
@@ -77,6 +82,7 @@ public:
 
 class ModAction : public Action {
 	friend class boost::serialization::access;
+	friend class ActionFile;
 	template<class Archive> void serialize(Archive & ar, const unsigned int version);
 protected:
 	ModAction() {}
@@ -89,6 +95,7 @@ public:
 
 class SendKey : public ModAction {
 	friend class boost::serialization::access;
+	friend class ActionFile;
 	guint key;
 	BOOST_SERIALIZATION_SPLIT_MEMBER()
 	template<class Archive> void load(Archive & ar, const unsigned int version);
@@ -110,6 +117,7 @@ BOOST_CLASS_VERSION(SendKey, 1)
 
 class SendText : public Action {
 	friend class boost::serialization::access;
+	friend class ActionFile;
 	Glib::ustring text;
 	BOOST_SERIALIZATION_SPLIT_MEMBER()
 	template<class Archive> void load(Archive & ar, const unsigned int version);
@@ -147,6 +155,7 @@ public:
 
 class Button : public ModAction {
 	friend class boost::serialization::access;
+	friend class ActionFile;
 	template<class Archive> void serialize(Archive & ar, const unsigned int version);
 	Button(Gdk::ModifierType mods, guint button_) : ModAction(mods), button(button_) {}
 	guint button;
@@ -216,7 +225,7 @@ public:
 	double score;
 	std::string name;
 	std::multimap<double, std::pair<std::string, RStroke> > r;
-	static void queue_show(RRanking r, RTriple e);
+	static void queue_show(RRanking r, const Triple &e);
 };
 
 class Unique {
@@ -227,9 +236,52 @@ public:
 	int i;
 };
 
+// A stroke of an action list together with the resolved action and name
+struct Template {
+	Unique *id;
+	RStroke stroke;
+	RAction action;
+	std::string name;
+};
+typedef boost::shared_ptr<const ClusterIndex> RClusterIndex;
+// What a template has to share with a stroke for Stroke::compare to compare
+// them at all: timeout, trigger, modifiers and button
+typedef std::tuple<bool, int, unsigned int, int> TemplateKey;
+inline TemplateKey template_key(const Stroke &s) {
+	return TemplateKey(s.timeout, s.trigger, s.modifiers, s.button);
+}
+// The templates in effect for an action list, with copies of their strokes
+// packed together for Stroke::compare_many
+struct Templates : public std::vector<Template> {
+	stroke_t **pack;
+	// The positions of the templates by their key, in ascending order
+	std::map<TemplateKey, std::vector<unsigned int> > buckets;
+	// The cluster index over pack, which is built in the background and
+	// stays empty until then
+	mutable std::mutex index_mutex;
+	mutable RClusterIndex index;
+	mutable bool index_requested;
+	// Whether the index has been checked against brute force, main thread
+	// only
+	mutable bool index_checked;
+	Templates() : pack(nullptr), index_requested(false), index_checked(false) {}
+	Templates(const Templates &) = delete;
+	~Templates() { stroke_pack_free(pack); }
+	RClusterIndex get_index() const {
+		std::lock_guard<std::mutex> lock(index_mutex);
+		return index;
+	}
+	// Append the positions of the templates that s can be compared with.
+	// With any_button, the button doesn't matter, as long as there is one
+	// or s ended in a timeout.
+	void find(const Stroke &s, bool any_button, std::vector<unsigned int> &is) const;
+};
+typedef boost::shared_ptr<const Templates> RTemplates;
+
 class ActionListDiff {
 	friend class boost::serialization::access;
 	friend class ActionDB;
+	friend class ActionFile;
 	template<class Archive> void serialize(Archive & ar, const unsigned int version);
 	ActionListDiff *parent;
 	std::set<Unique *> deleted;
@@ -237,6 +289,28 @@ class ActionListDiff {
 	std::list<Unique *> order;
 	std::list<ActionListDiff> children;
 
+	// Bumped on every change to any action list, which invalidates all
+	// cached template lists and resolved entries
+	static unsigned long generation;
+	mutable RTemplates templates;
+	mutable unsigned long templates_generation;
+
+	// An entry as it is in effect for this list, and which of its parts
+	// are set here rather than inherited
+	struct Resolved {
+		RStrokeInfo info;
+		bool deleted, stroke, name, action;
+		Resolved() : deleted(false), stroke(false), name(false), action(false) {}
+	};
+	// All entries of this list and its parents.  Entries that aren't
+	// changed here share their StrokeInfo with the parent.
+	mutable std::unordered_map<Unique *, Resolved> resolved;
+	mutable unsigned long resolved_generation;
+	void resolve() const;
+
+	// Remove id from this list and its children, without recording it
+	void erase(Unique *id);
+
 	void update_order() {
 		int j = 0;
 		for (std::list<Unique *>::iterator i = order.begin(); i != order.end(); i++, j++) {
@@ -262,12 +336,20 @@ public:
 	bool app;
 	std::string name;
 
-	ActionListDiff() : parent(0), level(0), app(false) {}
+	ActionListDiff() : parent(0), templates_generation(0), resolved_generation(0), level(0), app(false) {}
+
+	static void changed() { generation++; }
+	// Tells whether any action list has changed since it was generation()
+	static unsigned long get_generation() { return generation; }
+	// Changes to any action list are recorded here, if set
+	static ActionFile *journal;
 
 	typedef std::list<ActionListDiff>::iterator iterator;
 	iterator begin() { return children.begin(); }
 	iterator end() { return children.end(); }
 
+	// The entry id as it is in effect for this list.  The result is shared
+	// with the cache and mustn't be changed.
 	RStrokeInfo get_info(Unique *id, bool *deleted = 0, bool *stroke = 0, bool *name = 0, bool *action = 0) const;
 	int order_size() const { return order.size(); }
 	int size_rec() const {
@@ -280,21 +362,10 @@ public:
 		return parent && (added.count(id) || deleted.count(id)) && parent->contains(id);
 	}
 
-	Unique *add(StrokeInfo &si, Unique *before = 0) {
-		Unique *id = new Unique;
-		added.insert(std::pair<Unique *, StrokeInfo>(id, si));
-		id->level = level;
-		id->i = order.size();
-		if (before)
-			order.insert(std::find(order.begin(), order.end(), before), id);
-		else
-			order.push_back(id);
-		update_order();
-		return id;
-	}
-	void set_action(Unique *id, RAction action) { added[id].action = action; }
-	void set_strokes(Unique *id, StrokeSet strokes) { added[id].strokes = strokes; }
-	void set_name(Unique *id, std::string name) { added[id].name = name; }
+	Unique *add(StrokeInfo &si, Unique *before = 0);
+	void set_action(Unique *id, RAction action);
+	void set_strokes(Unique *id, StrokeSet strokes);
+	void set_name(Unique *id, std::string name);
 	bool contains(Unique *id) const {
 		if (deleted.count(id))
 			return false;
@@ -302,76 +373,36 @@ public:
 			return true;
 		return parent && parent->contains(id);
 	}
-	bool remove(Unique *id) {
-		bool really = !(parent && parent->contains(id));
-		if (really) {
-			added.erase(id);
-			order.remove(id);
-			update_order();
-		} else
-			deleted.insert(id);
-		for (std::list<ActionListDiff>::iterator i = children.begin(); i != children.end(); i++)
-			i->remove(id);
-		return really;
-	}
-	void reset(Unique *id) {
-		if (!parent)
-			return;
-		added.erase(id);
-		deleted.erase(id);
-	}
+	bool remove(Unique *id);
+	void reset(Unique *id);
 	void add_apps(std::map<std::string, ActionListDiff *> &apps) {
 		if (app)
 			apps[name] = this;
 		for (std::list<ActionListDiff>::iterator i = children.begin(); i != children.end(); i++)
 			i->add_apps(apps);
 	}
-	ActionListDiff *add_child(std::string name, bool app) {
-		children.push_back(ActionListDiff());
-		ActionListDiff *child = &(children.back());
-		child->name = name;
-		child->app = app;
-		child->parent = this;
-		child->level = level + 1;
-		return child;
-	}
-	bool remove() {
-		if (!parent)
-			return false;
-		for (std::list<ActionListDiff>::iterator i = parent->children.begin(); i != parent->children.end(); i++) {
-			if (&*i == this) {
-				parent->children.erase(i);
-				return true;
-			}
-
-		}
-		return false;
-	}
-	bool move(Unique *src, Unique *dest) {
-		if (!src)
-			return false;
-		if (src == dest)
-			return false;
-		if (parent && parent->contains(src))
-			return false;
-		if (dest && parent && parent->contains(dest))
-			return false;
-		if (!added.count(src))
-			return false;
-		if (dest && !added.count(dest))
-			return false;
-		order.remove(src);
-		order.insert(dest ? std::find(order.begin(), order.end(), dest) : order.end(), src);
-		update_order();
-		return true;
-	}
+	ActionListDiff *add_child(std::string name, bool app);
+	bool remove();
+	bool move(Unique *src, Unique *dest);
+	void rename(std::string name_);
 
 	boost::shared_ptr<std::map<Unique *, StrokeSet> > get_strokes() const;
+	// All strokes that are in effect for this list, in the same order as
+	// get_strokes().  The result is cached until the next change.
+	RTemplates get_templates() const;
+	// Have the cluster index of the templates built in the background, if
+	// enabled and not done yet
+	void request_index() const;
 	boost::shared_ptr<std::set<Unique *> > get_ids(bool include_deleted) const;
 	int count_actions() const {
 		return (parent ? parent->count_actions() : 0) + order.size() - deleted.size();
 	}
-	void all_strokes(std::list<RStroke> &strokes) const;
+	// If names is given, the name of the action of each stroke is added to it
+	void all_strokes(std::list<RStroke> &strokes, std::list<std::string> *names = nullptr) const;
+	// Rank all templates against s
+	void rank(RStroke s, RRanking &r) const;
+	// Find the action for s.  If r already holds the ranking for s, it is
+	// used as is.
 	RAction handle(RStroke s, RRanking &r) const;
 	// b1 is always reported as b2
 	void handle_advanced(RStroke s, std::map<guint, RAction> &a, std::map<guint, RRanking> &r, int b1, int b2) const;
@@ -383,6 +414,7 @@ BOOST_CLASS_VERSION(ActionListDiff, 1)
 class ActionDB {
 	friend class boost::serialization::access;
 	friend class ActionDBWatcher;
+	friend class ActionFile;
 	template<class Archive> void load(Archive & ar, const unsigned int version);
 	template<class Archive> void save(Archive & ar, const unsigned int version) const;
 	BOOST_SERIALIZATION_SPLIT_MEMBER()
@@ -408,8 +440,10 @@ BOOST_CLASS_VERSION(ActionDB, 3)
 
 class ActionDBWatcher : public TimeoutWatcher {
 	bool good_state;
+	ActionFile *file;
+	void prepare_strokes();
 public:
-	ActionDBWatcher() : TimeoutWatcher(5000), good_state(true) {}
+	ActionDBWatcher() : TimeoutWatcher(5000), good_state(true), file(nullptr) {}
 	void init();
 	virtual void timeout();
 };
@@ -0,0 +1,887 @@
+/*
+ * Copyright (c) 2009, Thomas Jaeger <ThJaeger@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "actionfile.h"
+#include "main.h"
+#include "saver.h"
+#include <glibmm/i18n.h>
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static const char magic[4] = { 'E', 'S', 'A', 'D' };
+static const char journal_magic[4] = { 'E', 'S', 'A', 'J' };
+// Bump these whenever the formats change.  Files of format 1 have no serial
+// number and are read as number 0.
+static const uint32_t format = 2;
+static const uint32_t journal_format = 1;
+static const size_t header_size = 9 * 4;
+static const size_t journal_header_size = 3 * 4;
+// Deeper nesting can't be created in the GUI
+static const int max_depth = 64;
+// The journal is folded into the file once it's larger than half the file,
+// but never before it reaches this size
+static const long min_journal_size = 64 * 1024;
+
+enum { ACTION_NONE, ACTION_COMMAND, ACTION_SENDKEY, ACTION_SENDTEXT, ACTION_SCROLL, ACTION_IGNORE,
+	ACTION_BUTTON, ACTION_MISC };
+
+enum { LOG_ADD = 1, LOG_SET_ACTION, LOG_SET_STROKES, LOG_SET_NAME, LOG_REMOVE, LOG_RESET, LOG_MOVE,
+	LOG_ADD_LIST, LOG_REMOVE_LIST, LOG_RENAME_LIST };
+
+static void put_word(unsigned char *p, uint32_t w) {
+	p[0] = w;
+	p[1] = w >> 8;
+	p[2] = w >> 16;
+	p[3] = w >> 24;
+}
+
+static uint32_t get_word(const unsigned char *p) {
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint32_t checked(size_t n) {
+	if (n > 0xffffffffUL)
+		throw std::runtime_error(_("action database too large"));
+	return n;
+}
+
+static void truncated() {
+	throw std::runtime_error(_("file is truncated"));
+}
+
+static void invalid(const char *what) {
+	throw std::runtime_error(what);
+}
+
+// A copy of an action list for the writer thread.  The actions and strokes
+// are shared with the database, which never changes them once created.
+struct ActionFile::List {
+	std::string name;
+	bool app;
+	std::set<Unique *> deleted;
+	std::map<Unique *, StrokeInfo> added;
+	std::list<Unique *> order;
+	std::list<List> children;
+};
+
+// What save hands to the writer thread
+struct ActionFile::Snapshot {
+	List root;
+	uint32_t serial;
+	std::map<const Unique *, uint32_t> ids;
+	std::vector<Unique *> uniques;
+
+	void number(Unique *id) {
+		uint32_t &n = ids[id];
+		if (!n) {
+			uniques.push_back(id);
+			n = uniques.size();
+		}
+	}
+
+	// Number the ids in the order put_list writes them, so that the main
+	// thread knows the numbering before the file is written
+	void copy(const ActionListDiff &from, List &to) {
+		to.name = from.name;
+		to.app = from.app;
+		to.deleted = from.deleted;
+		to.added = from.added;
+		to.order = from.order;
+		for (std::set<Unique *>::iterator i = to.deleted.begin(); i != to.deleted.end(); i++)
+			number(*i);
+		for (std::map<Unique *, StrokeInfo>::iterator i = to.added.begin(); i != to.added.end(); i++)
+			number(i->first);
+		for (std::list<Unique *>::iterator i = to.order.begin(); i != to.order.end(); i++)
+			number(*i);
+		for (std::list<ActionListDiff>::const_iterator i = from.children.begin(); i != from.children.end(); i++) {
+			to.children.push_back(List());
+			copy(*i, to.children.back());
+		}
+	}
+};
+
+// Encodes into words, either for the file, with strings, points, actions
+// and strokes in tables of their own, or for a journal record, with
+// everything inline
+class ActionFile::Writer {
+	bool inline_data;
+	std::map<const Unique *, uint32_t> &ids;
+	std::vector<Unique *> &uniques;
+	std::map<std::string, uint32_t> string_offsets;
+	std::map<const Action *, uint32_t> action_ids;
+	std::map<const Stroke *, uint32_t> stroke_ids;
+public:
+	std::vector<uint32_t> words;
+	std::string strings;
+	std::vector<unsigned char> points;
+	std::vector<const Action *> action_list;
+	std::vector<const Stroke *> stroke_list;
+
+	Writer(std::map<const Unique *, uint32_t> &ids_, std::vector<Unique *> &uniques_, bool inline_data_) :
+		inline_data(inline_data_), ids(ids_), uniques(uniques_) {}
+
+	void put(uint32_t w) { words.push_back(w); }
+
+	void put_bytes(const unsigned char *data, size_t size) {
+		put(checked(size));
+		for (size_t i = 0; i < size; i += 4) {
+			unsigned char w[4] = { 0, 0, 0, 0 };
+			memcpy(w, data + i, std::min<size_t>(4, size - i));
+			put(get_word(w));
+		}
+	}
+
+	void put_string(const std::string &s) {
+		if (inline_data) {
+			put_bytes((const unsigned char *)s.data(), s.size());
+			return;
+		}
+		std::map<std::string, uint32_t>::iterator i = string_offsets.find(s);
+		if (i == string_offsets.end()) {
+			i = string_offsets.insert(std::make_pair(s, checked(strings.size()))).first;
+			strings += s;
+		}
+		put(i->second);
+		put(checked(s.size()));
+	}
+
+	void put_id(Unique *id) {
+		if (!id) {
+			put(0);
+			return;
+		}
+		uint32_t &n = ids[id];
+		if (!n) {
+			uniques.push_back(id);
+			n = uniques.size();
+		}
+		put(n);
+	}
+
+	void put_action(const Action *action) {
+		if (const Command *a = dynamic_cast<const Command *>(action)) {
+			put(ACTION_COMMAND);
+			put_string(a->cmd);
+		} else if (const SendKey *a = dynamic_cast<const SendKey *>(action)) {
+			put(ACTION_SENDKEY);
+			put(((const ModAction *)a)->mods);
+			put(a->key);
+		} else if (const SendText *a = dynamic_cast<const SendText *>(action)) {
+			put(ACTION_SENDTEXT);
+			put_string(a->text);
+		} else if (const Scroll *a = dynamic_cast<const Scroll *>(action)) {
+			put(ACTION_SCROLL);
+			put(((const ModAction *)a)->mods);
+		} else if (const Ignore *a = dynamic_cast<const Ignore *>(action)) {
+			put(ACTION_IGNORE);
+			put(((const ModAction *)a)->mods);
+		} else if (const Button *a = dynamic_cast<const Button *>(action)) {
+			put(ACTION_BUTTON);
+			put(((const ModAction *)a)->mods);
+			put(a->button);
+		} else if (const Misc *a = dynamic_cast<const Misc *>(action)) {
+			put(ACTION_MISC);
+			put(a->type);
+		} else
+			put(ACTION_NONE);
+	}
+
+	void put_stroke(const Stroke *s) {
+		std::vector<unsigned char> data;
+		s->encode(data);
+		if (inline_data)
+			put_bytes(data.data(), data.size());
+		else {
+			put(checked(points.size()));
+			put(checked(data.size()));
+			points.insert(points.end(), data.begin(), data.end());
+		}
+		put(s->trigger);
+		put(s->button);
+		put(s->modifiers);
+		put(s->timeout);
+	}
+
+	void put_action_ref(const RAction &action) {
+		if (inline_data)
+			put_action(action.get());
+		else
+			put(action ? action_ids[action.get()] : 0);
+	}
+
+	void put_strokes(const StrokeSet &strokes) {
+		put(checked(strokes.size()));
+		for (StrokeSet::const_iterator i = strokes.begin(); i != strokes.end(); i++)
+			if (inline_data) {
+				put(!!*i);
+				if (*i)
+					put_stroke(i->get());
+			} else
+				put(*i ? stroke_ids[i->get()] : 0);
+	}
+
+	// The positions of the lists on the way down from the root
+	void put_path(const ActionListDiff *list) {
+		std::vector<uint32_t> path;
+		for (; list->parent; list = list->parent) {
+			uint32_t n = 0;
+			std::list<ActionListDiff>::const_iterator i = list->parent->children.begin();
+			for (; &*i != list; i++)
+				n++;
+			path.push_back(n);
+		}
+		put(checked(path.size()));
+		words.insert(words.end(), path.rbegin(), path.rend());
+	}
+
+	// Number the actions and strokes, so that ones that are shared between
+	// entries stay shared
+	void collect(const List &list) {
+		for (std::map<Unique *, StrokeInfo>::const_iterator i = list.added.begin(); i != list.added.end(); i++) {
+			const Action *action = i->second.action.get();
+			if (action && !action_ids.count(action)) {
+				action_list.push_back(action);
+				action_ids[action] = action_list.size();
+			}
+			for (StrokeSet::const_iterator j = i->second.strokes.begin(); j != i->second.strokes.end(); j++)
+				if (*j && !stroke_ids.count(j->get())) {
+					stroke_list.push_back(j->get());
+					stroke_ids[j->get()] = stroke_list.size();
+				}
+		}
+		for (std::list<List>::const_iterator i = list.children.begin(); i != list.children.end(); i++)
+			collect(*i);
+	}
+
+	void put_list(const List &list) {
+		put_string(list.name);
+		put(list.app);
+		put(checked(list.deleted.size()));
+		for (std::set<Unique *>::const_iterator i = list.deleted.begin(); i != list.deleted.end(); i++)
+			put_id(*i);
+		put(checked(list.added.size()));
+		for (std::map<Unique *, StrokeInfo>::const_iterator i = list.added.begin(); i != list.added.end(); i++) {
+			put_id(i->first);
+			put_string(i->second.name);
+			put_action_ref(i->second.action);
+			put_strokes(i->second.strokes);
+		}
+		put(checked(list.order.size()));
+		for (std::list<Unique *>::const_iterator i = list.order.begin(); i != list.order.end(); i++)
+			put_id(*i);
+		put(checked(list.children.size()));
+		for (std::list<List>::const_iterator i = list.children.begin(); i != list.children.end(); i++)
+			put_list(*i);
+	}
+
+	void put_database(const List &root) {
+		collect(root);
+		put(checked(action_list.size()));
+		for (std::vector<const Action *>::iterator i = action_list.begin(); i != action_list.end(); i++)
+			put_action(*i);
+		put(checked(stroke_list.size()));
+		for (std::vector<const Stroke *>::iterator i = stroke_list.begin(); i != stroke_list.end(); i++)
+			put_stroke(*i);
+		put_list(root);
+	}
+
+	std::vector<unsigned char> bytes(size_t offset = 0) const {
+		std::vector<unsigned char> out(offset + 4 * words.size());
+		for (unsigned int i = 0; i < words.size(); i++)
+			put_word(&out[offset + 4*i], words[i]);
+		return out;
+	}
+};
+
+// Decodes what Writer encodes, from memory that stays valid while reading
+class ActionFile::Reader {
+	const unsigned char *p, *end;
+	bool inline_data;
+	std::vector<Unique *> &uniques;
+	std::vector<RAction> actions;
+	std::vector<RStroke> strokes;
+public:
+	const unsigned char *strings, *points;
+	uint32_t string_size, points_size;
+
+	Reader(std::vector<Unique *> &uniques_, const unsigned char *p_, const unsigned char *end_, bool inline_data_) :
+		p(p_), end(end_), inline_data(inline_data_), uniques(uniques_),
+		strings(nullptr), points(nullptr), string_size(0), points_size(0) {}
+
+	uint32_t get() {
+		if (end - p < 4)
+			truncated();
+		uint32_t w = get_word(p);
+		p += 4;
+		return w;
+	}
+
+	// Inline data starts at the current position, the rest is in section
+	const unsigned char *get_bytes(const unsigned char *section, uint32_t section_size, uint32_t &size) {
+		if (inline_data) {
+			size = get();
+			const unsigned char *data = p;
+			if ((size_t)(end - p) / 4 < (size + 3ul) / 4)
+				truncated();
+			p += (size + 3ul) / 4 * 4;
+			return data;
+		}
+		uint32_t offset = get();
+		size = get();
+		if (offset > section_size || size > section_size - offset)
+			truncated();
+		return section + offset;
+	}
+
+	std::string get_string() {
+		uint32_t size;
+		const unsigned char *data = get_bytes(strings, string_size, size);
+		return std::string((const char *)data, size);
+	}
+
+	Unique *get_id(bool create) {
+		uint32_t n = get();
+		if (!n)
+			return nullptr;
+		if (create && n == uniques.size() + 1)
+			uniques.push_back(new Unique);
+		if (n > uniques.size())
+			invalid(_("invalid entry"));
+		return uniques[n-1];
+	}
+
+	RAction get_action() {
+		Gdk::ModifierType mods;
+		switch (get()) {
+		case ACTION_COMMAND:
+			return Command::create(get_string());
+		case ACTION_SENDKEY:
+			mods = (Gdk::ModifierType)get();
+			return SendKey::create(get(), mods);
+		case ACTION_SENDTEXT:
+			return SendText::create(get_string());
+		case ACTION_SCROLL:
+			return Scroll::create((Gdk::ModifierType)get());
+		case ACTION_IGNORE:
+			return Ignore::create((Gdk::ModifierType)get());
+		case ACTION_BUTTON:
+			mods = (Gdk::ModifierType)get();
+			return Button::create(mods, get());
+		case ACTION_MISC: {
+			uint32_t type = get();
+			if (type > Misc::DISABLE)
+				invalid(_("invalid action"));
+			return Misc::create((Misc::Type)type);
+		}
+		case ACTION_NONE:
+			return RAction();
+		default:
+			invalid(_("invalid action"));
+			return RAction();
+		}
+	}
+
+	RStroke get_stroke() {
+		uint32_t size;
+		// The points are decoded straight from the mapping
+		const unsigned char *data = get_bytes(points, points_size, size);
+		int trigger = get();
+		int button = get();
+		unsigned int modifiers = get();
+		bool timeout = get();
+		return Stroke::decode(data, size, trigger, button, modifiers, timeout);
+	}
+
+	RAction get_action_ref() {
+		if (inline_data)
+			return get_action();
+		uint32_t n = get();
+		if (n > actions.size())
+			invalid(_("invalid action"));
+		return n ? actions[n-1] : RAction();
+	}
+
+	void get_strokes(StrokeSet &set) {
+		for (uint32_t n = get(); n; n--)
+			if (inline_data)
+				set.insert(get() ? get_stroke() : RStroke());
+			else {
+				uint32_t k = get();
+				if (k > strokes.size())
+					invalid(_("invalid stroke"));
+				set.insert(k ? strokes[k-1] : RStroke());
+			}
+	}
+
+	ActionListDiff *get_path(ActionListDiff &root) {
+		ActionListDiff *list = &root;
+		uint32_t depth = get();
+		if (depth > (uint32_t)max_depth)
+			invalid(_("invalid action list"));
+		for (; depth; depth--) {
+			uint32_t n = get();
+			if (n >= list->children.size())
+				invalid(_("invalid action list"));
+			std::list<ActionListDiff>::iterator i = list->children.begin();
+			std::advance(i, n);
+			list = &*i;
+		}
+		return list;
+	}
+
+	void get_list(ActionListDiff &list, int depth) {
+		if (depth > max_depth)
+			invalid(_("invalid action list"));
+		list.name = get_string();
+		list.app = get();
+		for (uint32_t n = get(); n; n--) {
+			Unique *id = get_id(true);
+			if (!id)
+				invalid(_("invalid entry"));
+			list.deleted.insert(id);
+		}
+		for (uint32_t n = get(); n; n--) {
+			Unique *id = get_id(true);
+			if (!id)
+				invalid(_("invalid entry"));
+			StrokeInfo &si = list.added[id];
+			si.name = get_string();
+			si.action = get_action_ref();
+			get_strokes(si.strokes);
+		}
+		for (uint32_t n = get(); n; n--) {
+			Unique *id = get_id(true);
+			if (!id)
+				invalid(_("invalid entry"));
+			list.order.push_back(id);
+		}
+		for (uint32_t n = get(); n; n--) {
+			list.children.push_back(ActionListDiff());
+			get_list(list.children.back(), depth + 1);
+		}
+	}
+
+	void get_database(ActionListDiff &root) {
+		for (uint32_t n = get(); n; n--)
+			actions.push_back(get_action());
+		for (uint32_t n = get(); n; n--)
+			strokes.push_back(get_stroke());
+		get_list(root, 0);
+	}
+
+	bool done() const { return p == end; }
+};
+
+ActionFile::ActionFile(const std::string &filename_) :
+	filename(filename_), journal_filename(filename_ + ".journal"), serial(0),
+	file_size(0), journal_size(0), compact(true), journal_ok(false) {}
+
+bool ActionFile::is_binary(const std::string &filename) {
+	FILE *file = fopen(filename.c_str(), "rb");
+	if (!file)
+		return false;
+	char buf[4];
+	bool binary = fread(buf, 1, 4, file) == 4 && !memcmp(buf, magic, 4);
+	fclose(file);
+	return binary;
+}
+
+// Unmaps the file when loading is done, however it ends
+struct Mapping {
+	void *data;
+	size_t size;
+	Mapping() : data(MAP_FAILED), size(0) {}
+	~Mapping() {
+		if (data != MAP_FAILED)
+			munmap(data, size);
+	}
+};
+
+void ActionFile::load(ActionDB &db) {
+	Mapping m;
+	int fd = open(filename.c_str(), O_RDONLY);
+	if (fd < 0)
+		throw std::runtime_error(_("open() failed"));
+	struct stat st;
+	if (fstat(fd, &st) || st.st_size < 8) {
+		close(fd);
+		truncated();
+	}
+	m.size = st.st_size;
+	m.data = mmap(nullptr, m.size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (m.data == MAP_FAILED)
+		throw std::runtime_error(_("mmap() failed"));
+
+	const unsigned char *base = (const unsigned char *)m.data;
+	if (memcmp(base, magic, 4))
+		invalid(_("not an action database"));
+	uint32_t version = get_word(base + 4);
+	if (version != 1 && version != format)
+		invalid(_("unknown format version"));
+	if (m.size < (version == 1 ? 8 * 4 : header_size))
+		truncated();
+	uint32_t offsets[6];
+	for (int i = 0; i < 6; i++)
+		offsets[i] = get_word(base + 8 + 4*i);
+	for (int i = 0; i < 6; i += 2)
+		if (offsets[i] > m.size || offsets[i+1] > m.size - offsets[i])
+			truncated();
+
+	uniques.clear();
+	Reader r(uniques, base + offsets[4], base + offsets[4] + offsets[5], false);
+	r.strings = base + offsets[0];
+	r.string_size = offsets[1];
+	r.points = base + offsets[2];
+	r.points_size = offsets[3];
+	r.get_database(db.root);
+	serial = version == 1 ? 0 : get_word(base + 32);
+	ids.clear();
+	for (unsigned int i = 0; i < uniques.size(); i++)
+		ids[uniques[i]] = i + 1;
+	file_size = m.size;
+	compact = false;
+
+	db.root.fix_tree(false);
+	replay(db);
+	journal_ok = !compact;
+	db.apps.clear();
+	db.root.add_apps(db.apps);
+	ActionListDiff::changed();
+	db.root.name = _("Default");
+}
+
+// Apply the records of the journal up to the first one that doesn't make
+// sense.  If there is such a record, or the journal doesn't belong to the
+// file, the next save starts over with a new file.
+void ActionFile::replay(ActionDB &db) {
+	journal_size = 0;
+	std::ifstream ifs(journal_filename.c_str(), std::ios::binary);
+	if (ifs.fail()) {
+		compact = true;
+		return;
+	}
+	std::vector<unsigned char> data((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+	if (data.size() < journal_header_size || memcmp(data.data(), journal_magic, 4) ||
+			get_word(&data[4]) != journal_format || get_word(&data[8]) != serial) {
+		compact = true;
+		return;
+	}
+	// The records are applied through the usual functions, which mustn't
+	// record them again
+	ActionFile *journal = ActionListDiff::journal;
+	ActionListDiff::journal = nullptr;
+	const unsigned char *p = data.data() + journal_header_size, *end = data.data() + data.size();
+	int records = 0;
+	try {
+		while (p != end) {
+			// A record that was cut off by a crash is simply dropped
+			if (end - p < 4 || (size_t)(end - p - 4) / 4 < get_word(p)) {
+				compact = true;
+				break;
+			}
+			const unsigned char *next = p + 4 + 4 * (size_t)get_word(p);
+			Reader r(uniques, p + 4, next, true);
+			apply(r, db);
+			p = next;
+			records++;
+		}
+	} catch (std::exception &e) {
+		printf(_("Error: Couldn't replay the changes to the action database: %s.\n"), e.what());
+		compact = true;
+	}
+	ActionListDiff::journal = journal;
+	journal_size = p - data.data();
+	if (verbosity >= 2)
+		printf("Replayed %d changes to the actions.\n", records);
+}
+
+void ActionFile::apply(Reader &r, ActionDB &db) {
+	uint32_t op = r.get();
+	ActionListDiff *list = r.get_path(db.root);
+	switch (op) {
+	case LOG_ADD: {
+		uint32_t n = r.get();
+		if (n != uniques.size() + 1)
+			invalid(_("invalid entry"));
+		Unique *before = r.get_id(false);
+		StrokeInfo si;
+		si.name = r.get_string();
+		si.action = r.get_action();
+		r.get_strokes(si.strokes);
+		Unique *id = list->add(si, before);
+		uniques.push_back(id);
+		ids[id] = n;
+		break;
+	}
+	case LOG_SET_ACTION: {
+		Unique *id = r.get_id(false);
+		list->set_action(id, r.get_action());
+		break;
+	}
+	case LOG_SET_STROKES: {
+		Unique *id = r.get_id(false);
+		StrokeSet strokes;
+		r.get_strokes(strokes);
+		list->set_strokes(id, strokes);
+		break;
+	}
+	case LOG_SET_NAME: {
+		Unique *id = r.get_id(false);
+		list->set_name(id, r.get_string());
+		break;
+	}
+	case LOG_REMOVE:
+		list->remove(r.get_id(false));
+		break;
+	case LOG_RESET:
+		list->reset(r.get_id(false));
+		break;
+	case LOG_MOVE: {
+		Unique *src = r.get_id(false);
+		list->move(src, r.get_id(false));
+		break;
+	}
+	case LOG_ADD_LIST: {
+		std::string name = r.get_string();
+		list->add_child(name, r.get());
+		break;
+	}
+	case LOG_REMOVE_LIST:
+		list->remove();
+		break;
+	case LOG_RENAME_LIST:
+		list->rename(r.get_string());
+		break;
+	default:
+		invalid(_("invalid change"));
+	}
+	if (!r.done())
+		invalid(_("invalid change"));
+}
+
+std::function<void()> ActionFile::save(const ActionDB &db) {
+	boost::shared_ptr<Snapshot> s(new Snapshot);
+	s->copy(db.root, s->root);
+	s->serial = ++serial;
+	// The journal is started over with the numbering of the new file
+	ids = s->ids;
+	uniques = s->uniques;
+	pending.clear();
+	journal_size = journal_header_size;
+	compact = false;
+	return [this, s]() { write(*s); };
+}
+
+void ActionFile::write(Snapshot &s) {
+	// Until the new journal is in place, the old one doesn't fit either
+	// file, so nothing may be appended to it
+	journal_ok = false;
+	Writer w(s.ids, s.uniques, false);
+	w.put_database(s.root);
+	std::vector<unsigned char> out = w.bytes(header_size);
+	uint32_t string_offset = checked(out.size());
+	uint32_t stroke_offset = checked(string_offset + w.strings.size());
+	checked(stroke_offset + w.points.size());
+	memcpy(&out[0], magic, 4);
+	put_word(&out[4], format);
+	put_word(&out[8], string_offset);
+	put_word(&out[12], w.strings.size());
+	put_word(&out[16], stroke_offset);
+	put_word(&out[20], w.points.size());
+	put_word(&out[24], header_size);
+	put_word(&out[28], 4 * w.words.size());
+	put_word(&out[32], s.serial);
+	out.insert(out.end(), w.strings.begin(), w.strings.end());
+	out.insert(out.end(), w.points.begin(), w.points.end());
+	// If we crash in between, the old journal is left with the new file,
+	// and it is ignored because of its serial number
+	replace_file(filename, out.data(), out.size());
+	std::vector<unsigned char> header(journal_header_size);
+	memcpy(&header[0], journal_magic, 4);
+	put_word(&header[4], journal_format);
+	put_word(&header[8], s.serial);
+	replace_file(journal_filename, header.data(), header.size());
+	file_size = out.size();
+	journal_ok = true;
+}
+
+std::function<void()> ActionFile::flush() {
+	boost::shared_ptr<std::vector<uint32_t> > records(new std::vector<uint32_t>);
+	records->swap(pending);
+	journal_size += 4 * records->size();
+	return [this, records]() { append(*records); };
+}
+
+void ActionFile::append(const std::vector<uint32_t> &records) {
+	if (records.empty())
+		return;
+	if (!journal_ok)
+		throw std::runtime_error(_("the journal is out of date"));
+	std::vector<unsigned char> out(4 * records.size());
+	for (unsigned int i = 0; i < records.size(); i++)
+		put_word(&out[4*i], records[i]);
+	// A partial record can't be appended to
+	journal_ok = false;
+	int fd = open(journal_filename.c_str(), O_WRONLY | O_APPEND);
+	if (fd < 0)
+		throw std::runtime_error(_("open() failed"));
+	const unsigned char *p = out.data();
+	size_t size = out.size();
+	while (size) {
+		ssize_t n = ::write(fd, p, size);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			close(fd);
+			throw std::runtime_error(_("write() failed"));
+		}
+		p += n;
+		size -= n;
+	}
+	if (fsync(fd)) {
+		close(fd);
+		throw std::runtime_error(_("fsync() failed"));
+	}
+	if (close(fd))
+		throw std::runtime_error(_("close() failed"));
+	journal_ok = true;
+}
+
+bool ActionFile::needs_compaction() const {
+	return compact || journal_size + 4 * (long)pending.size() > std::max(file_size.load() / 2, min_journal_size);
+}
+
+void ActionFile::log(Writer &w) {
+	pending.push_back(checked(w.words.size()));
+	pending.insert(pending.end(), w.words.begin(), w.words.end());
+}
+
+void ActionFile::log_add(const ActionListDiff *list, Unique *id, Unique *before, const StrokeInfo &si) {
+	if (compact)
+		return;
+	Writer w(ids, uniques, true);
+	w.put(LOG_ADD);
+	w.put_path(list);
+	w.put_id(id);
+	w.put_id(before);
+	w.put_string(si.name);
+	w.put_action(si.action.get());
+	w.put_strokes(si.strokes);
+	log(w);
+}
+
+void ActionFile::log_set_action(const ActionListDiff *list, Unique *id, RAction action) {
+	if (compact)
+		return;
+	Writer w(ids, uniques, true);
+	w.put(LOG_SET_ACTION);
+	w.put_path(list);
+	w.put_id(id);
+	w.put_action(action.get());
+	log(w);
+}
+
+void ActionFile::log_set_strokes(const ActionListDiff *list, Unique *id, const StrokeSet &strokes) {
+	if (compact)
+		return;
+	Writer w(ids, uniques, true);
+	w.put(LOG_SET_STROKES);
+	w.put_path(list);
+	w.put_id(id);
+	w.put_strokes(strokes);
+	log(w);
+}
+
+void ActionFile::log_set_name(const ActionListDiff *list, Unique *id, const std::string &name) {
+	if (compact)
+		return;
+	Writer w(ids, uniques, true);
+	w.put(LOG_SET_NAME);
+	w.put_path(list);
+	w.put_id(id);
+	w.put_string(name);
+	log(w);
+}
+
+void ActionFile::log_remove(const ActionListDiff *list, Unique *id) {
+	if (compact)
+		return;
+	Writer w(ids, uniques, true);
+	w.put(LOG_REMOVE);
+	w.put_path(list);
+	w.put_id(id);
+	log(w);
+}
+
+void ActionFile::log_reset(const ActionListDiff *list, Unique *id) {
+	if (compact)
+		return;
+	Writer w(ids, uniques, true);
+	w.put(LOG_RESET);
+	w.put_path(list);
+	w.put_id(id);
+	log(w);
+}
+
+void ActionFile::log_move(const ActionListDiff *list, Unique *src, Unique *dest) {
+	if (compact)
+		return;
+	Writer w(ids, uniques, true);
+	w.put(LOG_MOVE);
+	w.put_path(list);
+	w.put_id(src);
+	w.put_id(dest);
+	log(w);
+}
+
+void ActionFile::log_add_list(const ActionListDiff *parent, const std::string &name, bool app) {
+	if (compact)
+		return;
+	Writer w(ids, uniques, true);
+	w.put(LOG_ADD_LIST);
+	w.put_path(parent);
+	w.put_string(name);
+	w.put(app);
+	log(w);
+}
+
+void ActionFile::log_remove_list(const ActionListDiff *list) {
+	if (compact)
+		return;
+	Writer w(ids, uniques, true);
+	w.put(LOG_REMOVE_LIST);
+	w.put_path(list);
+	log(w);
+}
+
+void ActionFile::log_rename_list(const ActionListDiff *list, const std::string &name) {
+	if (compact)
+		return;
+	Writer w(ids, uniques, true);
+	w.put(LOG_RENAME_LIST);
+	w.put_path(list);
+	w.put_string(name);
+	log(w);
+}
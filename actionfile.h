@@ -0,0 +1,118 @@
+/*
+ * Copyright (c) 2009, Thomas Jaeger <ThJaeger@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#ifndef __ACTIONFILE_H__
+#define __ACTIONFILE_H__
+#include "actiondb.h"
+#include <map>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <functional>
+#include <stdint.h>
+
+/* The binary format of the action database, which is read straight from a
+ * memory mapping of the file.  All numbers are 32 bit little endian words.
+ * The file starts with a header:
+ *     magic, format version
+ *     offset and size of the string section
+ *     offset and size of the stroke section
+ *     offset and size of the tree section
+ *     serial number
+ * The string section holds the bytes of all strings, which are referred to
+ * by offset and length.  The stroke section holds the points of all strokes
+ * as encoded by stroke_encode.  The tree section is a sequence of words:
+ *     the actions, each a type followed by its fields
+ *     the strokes, each the offset and size of its points, trigger, button,
+ *         modifiers and timeout
+ *     the root action list
+ * An action list is its name and whether it's an app, followed by the
+ * deleted ids, the added ids with name, action and strokes, the order and
+ * the child lists, each prefixed by their number.  Actions and strokes are
+ * referred to by their index, starting at 1 so that 0 can mean none, and so
+ * are the ids of the entries.
+ *
+ * Changes since the file was written are appended to a journal next to it,
+ * which starts with a magic, its format version and the serial number of
+ * the file it belongs to.  Each record is the number of words that follow,
+ * the type of change and the list it applies to, as the positions of the
+ * lists on the way down from the root.  The ids of the entries continue the
+ * numbering of the file.  Strings and points are stored in the record
+ * itself, as their size in bytes followed by the bytes, padded to a word.
+ * Loading replays the journal on top of the file.  Once the journal has
+ * grown large compared to the file, the whole database is written to a new
+ * file with an empty journal.
+ */
+class ActionFile {
+	class Writer;
+	class Reader;
+	struct List;
+	struct Snapshot;
+
+	std::string filename, journal_filename;
+	uint32_t serial;
+	// The numbers of the ids that the file and the journal refer to
+	std::map<const Unique *, uint32_t> ids;
+	std::vector<Unique *> uniques;
+	// Records that haven't been appended to the journal yet
+	std::vector<uint32_t> pending;
+	// Set by the writer thread once it knows
+	std::atomic<long> file_size;
+	long journal_size;
+	bool compact;
+	// Whether the journal on disk fits the file.  Only the writer thread
+	// uses this after loading.
+	bool journal_ok;
+
+	void log(Writer &w);
+	void replay(ActionDB &db);
+	void apply(Reader &r, ActionDB &db);
+	void write(Snapshot &s);
+	void append(const std::vector<uint32_t> &records);
+public:
+	explicit ActionFile(const std::string &filename);
+	// Whether filename starts like a file of this format
+	static bool is_binary(const std::string &filename);
+
+	// Load the file and replay as much of its journal as possible.  Throws
+	// std::runtime_error on failure.
+	void load(ActionDB &db);
+	// save and flush take a copy of what has to be written and return the
+	// job that writes it, which may run on any thread.  The jobs run in
+	// order and throw std::runtime_error on failure, after which
+	// set_compaction has to be called.
+	// Write the whole database to a new file and start an empty journal
+	std::function<void()> save(const ActionDB &db);
+	// Append the changes logged so far to the journal
+	std::function<void()> flush();
+	// Whether the next save has to write the whole database, because the
+	// journal has grown too large or doesn't fit the file
+	bool needs_compaction() const;
+	void set_compaction() { compact = true; }
+
+	// Called by ActionListDiff for every change
+	void log_add(const ActionListDiff *list, Unique *id, Unique *before, const StrokeInfo &si);
+	void log_set_action(const ActionListDiff *list, Unique *id, RAction action);
+	void log_set_strokes(const ActionListDiff *list, Unique *id, const StrokeSet &strokes);
+	void log_set_name(const ActionListDiff *list, Unique *id, const std::string &name);
+	void log_remove(const ActionListDiff *list, Unique *id);
+	void log_reset(const ActionListDiff *list, Unique *id);
+	void log_move(const ActionListDiff *list, Unique *src, Unique *dest);
+	void log_add_list(const ActionListDiff *parent, const std::string &name, bool app);
+	void log_remove_list(const ActionListDiff *list);
+	void log_rename_list(const ActionListDiff *list, const std::string &name);
+};
+
+#endif
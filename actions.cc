@@ -609,7 +609,7 @@ void Actions::on_group_name_edited(const Glib::ustring& path, const Glib::ustrin
 	Gtk::TreeRow row(*apps_model->get_iter(path));
 	row[ca.app] = new_text;
 	ActionListDiff *as = row[ca.actions];
-	as->name = new_text;
+	as->rename(new_text);
 	update_actions();
 }
 
@@ -0,0 +1,139 @@
+/*
+ * Copyright (c) 2009, Thomas Jaeger <ThJaeger@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "cluster.h"
+#include <algorithm>
+
+// Since comparisons are cut off at stroke_infinity, a cluster can only ever
+// be skipped if its radius is well below that.  New clusters are started
+// until every stroke is this close to its medoid,
+static const double target_radius = 0.05;
+// or until the clusters get so small that they don't save anything.
+static const int min_cluster_size = 4;
+// Finding the best medoid of a cluster takes a quadratic number of
+// comparisons, so larger clusters keep the one they started with.
+static const int max_refine_size = 32;
+// The triangle inequality is off by up to this much for most strokes, so the
+// members of a cluster that is closer than that to being kept are compared
+// one by one.
+static const double verify_margin = 0.03;
+
+ClusterIndex::ClusterIndex(const stroke_t *const *strokes_, int n) : strokes(strokes_), medoids(nullptr) {
+	std::vector<int> ids;
+	for (int i = 0; i < n; i++)
+		if (strokes[i])
+			ids.push_back(i);
+	int m = ids.size();
+	if (!m)
+		return;
+	stroke_workspace_t *ws = stroke_workspace_alloc();
+
+	// Pick the medoids farthest first: each one is the stroke that is
+	// farthest from all medoids so far
+	std::vector<double> nearest(m, stroke_infinity);
+	std::vector<int> owner(m, -1);
+	std::vector<int> centers;
+	int max_clusters = std::max(1, m / min_cluster_size);
+	for (int far = 0; far >= 0 && (int)centers.size() < max_clusters;) {
+		int c = centers.size();
+		centers.push_back(far);
+		const stroke_t *center = strokes[ids[far]];
+		far = -1;
+		double far_cost = target_radius;
+		for (int i = 0; i < m; i++) {
+			double cost = stroke_compare_bounded(ws, strokes[ids[i]], center, nearest[i]);
+			if (cost < nearest[i] || i == centers[c]) {
+				nearest[i] = cost;
+				owner[i] = c;
+			}
+			if (nearest[i] > far_cost) {
+				far = i;
+				far_cost = nearest[i];
+			}
+		}
+	}
+
+	// Move each medoid to the member that the others are closest to
+	for (unsigned int c = 0; c < centers.size(); c++) {
+		std::vector<int> members;
+		for (int i = 0; i < m; i++)
+			if (owner[i] == (int)c)
+				members.push_back(i);
+		if (members.size() > (unsigned int)max_refine_size)
+			continue;
+		double best = stroke_infinity;
+		for (std::vector<int>::iterator j = members.begin(); j != members.end(); j++) {
+			double radius = 0.0;
+			for (std::vector<int>::iterator i = members.begin(); i != members.end() && radius < best; i++)
+				radius = std::max(radius, stroke_compare_bounded(ws, strokes[ids[*i]], strokes[ids[*j]], best));
+			if (radius < best) {
+				best = radius;
+				centers[c] = *j;
+			}
+		}
+	}
+
+	// Assign every stroke to its closest medoid.  Strokes that aren't close
+	// to any of them belong to no cluster.
+	std::vector<const stroke_t *> ms;
+	for (std::vector<int>::iterator c = centers.begin(); c != centers.end(); c++)
+		ms.push_back(strokes[ids[*c]]);
+	medoids = stroke_pack(ms.data(), ms.size());
+	clusters.resize(centers.size());
+	for (unsigned int c = 0; c < centers.size(); c++) {
+		clusters[c].medoid = ids[centers[c]];
+		clusters[c].radius = 0.0;
+	}
+	std::vector<double> costs(centers.size());
+	for (int i = 0; i < m; i++) {
+		int c = stroke_compare_many(ws, strokes[ids[i]], medoids, centers.size(), costs.data(),
+				stroke_infinity, STROKE_BOUND_RUNNING);
+		if (c < 0)
+			continue;
+		clusters[c].members.push_back(ids[i]);
+		clusters[c].radius = std::max(clusters[c].radius, costs[c]);
+	}
+	stroke_workspace_free(ws);
+}
+
+ClusterIndex::~ClusterIndex() {
+	stroke_pack_free(medoids);
+}
+
+int ClusterIndex::prune(stroke_workspace_t *ws, const stroke_t *q, double max_cost, std::vector<bool> &skip) const {
+	if (clusters.empty())
+		return 0;
+	std::vector<double> costs(clusters.size());
+	stroke_compare_many(ws, q, medoids, clusters.size(), costs.data(), stroke_infinity, STROKE_BOUND_FIXED);
+	// A cost that was cut off at stroke_infinity is still a lower bound
+	int comparisons = clusters.size();
+	for (unsigned int c = 0; c < clusters.size(); c++) {
+		double margin = costs[c] - clusters[c].radius - max_cost;
+		if (margin < 0.0)
+			continue;
+		bool verify = margin < verify_margin;
+		for (std::vector<int>::const_iterator i = clusters[c].members.begin(); i != clusters[c].members.end(); i++) {
+			if (skip[*i])
+				continue;
+			if (verify) {
+				comparisons++;
+				if (stroke_compare_bounded(ws, q, strokes[*i], max_cost) < max_cost)
+					continue;
+			}
+			skip[*i] = true;
+		}
+	}
+	return comparisons;
+}
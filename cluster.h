@@ -0,0 +1,50 @@
+/*
+ * Copyright (c) 2009, Thomas Jaeger <ThJaeger@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#ifndef __CLUSTER_H__
+#define __CLUSTER_H__
+#include "stroke.h"
+#include <vector>
+
+/* Groups strokes into clusters around medoids, using the cost of
+ * stroke_compare as the distance, so that a whole cluster can be skipped when
+ * its medoid is far enough from the stroke being looked up.  The cost isn't
+ * a metric, so skipping relies on the triangle inequality holding roughly.
+ * Clusters that only just qualify are therefore checked member by member,
+ * and only those that are far out are skipped as a whole.
+ */
+class ClusterIndex {
+	struct Cluster {
+		int medoid;
+		double radius; // the largest cost from a member to the medoid
+		std::vector<int> members;
+	};
+	std::vector<Cluster> clusters;
+	const stroke_t *const *strokes;
+	stroke_t **medoids;
+public:
+	// strokes may contain NULLs, which are never skipped.  The strokes must
+	// outlive the index.
+	ClusterIndex(const stroke_t *const *strokes, int n);
+	ClusterIndex(const ClusterIndex &) = delete;
+	~ClusterIndex();
+	int size() const { return clusters.size(); }
+	// Mark the strokes that can't come within max_cost of q in skip.
+	// Returns the number of comparisons this took, including the members
+	// that had to be checked one by one.
+	int prune(stroke_workspace_t *ws, const stroke_t *q, double max_cost, std::vector<bool> &skip) const;
+};
+
+#endif
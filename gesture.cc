@@ -20,42 +20,116 @@
 #include <boost/archive/text_iarchive.hpp>
 #include <boost/serialization/vector.hpp>
 #include <boost/serialization/export.hpp>
+#include <boost/serialization/binary_object.hpp>
+
+#include <stdexcept>
 
 BOOST_CLASS_EXPORT(Stroke)
 
-void update_triple(RTriple e, float x, float y, Time t) {
-	e->x = x;
-	e->y = y;
-	e->t = t;
+// Enough for a stroke of a few seconds
+static const unsigned int initial_samples = 1024;
+// Nesting handlers only ever keep a couple of strokes alive at once
+static const unsigned int max_spare = 4;
+
+std::vector<std::vector<Triple> > PreStroke::spare;
+
+PreStroke::PreStroke() {
+	if (spare.empty()) {
+		reserve(initial_samples);
+		return;
+	}
+	swap(spare.back());
+	spare.pop_back();
+}
+
+PreStroke::~PreStroke() {
+	if (spare.size() >= max_spare)
+		return;
+	clear();
+	spare.push_back(std::vector<Triple>());
+	spare.back().swap(*this);
+}
+
+void Stroke::encode(std::vector<unsigned char> &data) const {
+	data.clear();
+	if (const stroke_t *s = original.get()) {
+		data.resize(stroke_encoded_size(s));
+		data.resize(stroke_encode(s, data.data()));
+	}
+}
+
+// A copy of s for matching, with at most max_points points
+static stroke_t *resampled(const stroke_t *s) {
+	int n = stroke_get_size(s);
+	stroke_t *r = stroke_alloc(n);
+	for (int i = 0; i < n; i++) {
+		double x, y;
+		stroke_get_point(s, i, &x, &y);
+		stroke_add_point(r, x, y);
+	}
+	stroke_resample(r, prefs.max_points.get());
+	return r;
+}
+
+void Stroke::set_points(stroke_t *s) {
+	original.reset(s, &stroke_free);
+	stroke.reset(resampled(s), &stroke_free);
+	finished = false;
 }
 
-RTriple create_triple(float x, float y, Time t) {
-	RTriple e(new Triple);
-	update_triple(e, x, y, t);
-	return e;
+RStroke Stroke::decode(const unsigned char *data, size_t size, int trigger, int button, unsigned int modifiers, bool timeout) {
+	RStroke s(new Stroke);
+	if (size) {
+		stroke_t *points = stroke_decode(data, size);
+		if (!points)
+			throw std::runtime_error("invalid stroke data");
+		s->set_points(points);
+	}
+	s->trigger = trigger;
+	s->button = button;
+	s->modifiers = modifiers;
+	s->timeout = timeout;
+	return s;
 }
 
 template<class Archive> void Stroke::save(Archive & ar, const unsigned int version) const {
-	std::vector<Point> ps;
-	for (unsigned int i = 0; i < size(); i++)
-		ps.push_back(points(i));
-	ar & ps;
+	std::vector<unsigned char> data;
+	encode(data);
+	unsigned int size = data.size();
+	ar & size;
+	if (size) {
+		boost::serialization::binary_object bin = boost::serialization::make_binary_object(data.data(), size);
+		ar & bin;
+	}
 	ar & button;
 	ar & trigger;
 	ar & timeout;
 	ar & modifiers;
 }
-
 template<class Archive> void Stroke::load(Archive & ar, const unsigned int version) {
-	std::vector<Point> ps;
-	ar & ps;
-	if (ps.size()) {
-		stroke_t *s = stroke_alloc(ps.size());
-		for (std::vector<Point>::iterator i = ps.begin(); i != ps.end(); ++i)
-			stroke_add_point(s, i->x, i->y);
-		stroke_finish(s);
-		stroke.reset(s, &stroke_free);
+	stroke_t *s = nullptr;
+	if (version >= 6) {
+		unsigned int size;
+		ar & size;
+		if (size) {
+			std::vector<unsigned char> data(size);
+			boost::serialization::binary_object bin = boost::serialization::make_binary_object(data.data(), size);
+			ar & bin;
+			s = stroke_decode(data.data(), size);
+			if (!s)
+				throw std::runtime_error("invalid stroke data");
+		}
+	} else {
+		std::vector<Point> ps;
+		ar & ps;
+		if (ps.size()) {
+			s = stroke_alloc(ps.size());
+			for (std::vector<Point>::iterator i = ps.begin(); i != ps.end(); ++i)
+				stroke_add_point(s, i->x, i->y);
+		}
 	}
+	if (s)
+		set_points(s);
 	if (version == 0) return;
 	ar & button;
 	if (version >= 2)
@@ -70,17 +144,35 @@ template<class Archive> void Stroke::load(Archive & ar, const unsigned int versi
 	ar & modifiers;
 }
 
-Stroke::Stroke(PreStroke &ps, int trigger_, int button_, unsigned int modifiers_, bool timeout_) : trigger(trigger_), button(button_), modifiers(modifiers_), timeout(timeout_) {
+Stroke::Stroke(PreStroke &ps, int trigger_, int button_, unsigned int modifiers_, bool timeout_) : finished(true), trigger(trigger_), button(button_), modifiers(modifiers_), timeout(timeout_) {
 	if (ps.valid()) {
 		stroke_t *s = stroke_alloc(ps.size());
-		for (std::vector<RTriple>::iterator i = ps.begin(); i != ps.end(); ++i)
-			stroke_add_point(s, (*i)->x, (*i)->y);
+		for (PreStroke::iterator i = ps.begin(); i != ps.end(); ++i)
+			stroke_add_point(s, i->x, i->y);
+		original.reset(s, &stroke_free);
+		s = resampled(s);
 		stroke_finish(s);
 		stroke.reset(s, &stroke_free);
 	}
 }
 
-int Stroke::compare(RStroke a, RStroke b, double &score) {
+// The copy shares the points, so they have to be finished first
+Stroke::Stroke(const Stroke &s) : original(s.original), stroke((s.prepare(), s.stroke)), finished(true),
+	trigger(s.trigger), button(s.button), modifiers(s.modifiers), timeout(s.timeout) {}
+
+void Stroke::prepare() const {
+	if (ready())
+		return;
+	std::lock_guard<std::mutex> lock(prepare_mutex);
+	if (finished.load(std::memory_order_relaxed))
+		return;
+	stroke_finish(stroke.get());
+	finished.store(true, std::memory_order_release);
+}
+
+// Whether a and b can be compared at all: -1 if not, 1 if they match without
+// a comparison, 0 if the cost of their strokes decides
+static int comparable(const RStroke &a, const RStroke &b, double &score) {
 	score = 0.0;
 	if (!a || !b)
 		return -1;
@@ -92,21 +184,47 @@ int Stroke::compare(RStroke a, RStroke b, double &score) {
 		return -1;
 	if (a->modifiers != b->modifiers)
 		return -1;
-	if (!a->stroke || !b->stroke) {
-		if (!a->stroke && !b->stroke) {
+	if (!a->get() || !b->get()) {
+		if (!a->get() && !b->get()) {
 			score = 1.0;
 			return 1;
 		}
 		return -1;
 	}
-	double cost = stroke_compare(a->stroke.get(), b->stroke.get(), nullptr, nullptr);
-	if (cost >= stroke_infinity)
-		return -1;
-	score = MAX(1.0 - 2.5*cost, 0.0);
-	if (a->timeout)
-		return score > 0.85;
-	else
-		return score > 0.7;
+	return 0;
+}
+
+// The bound is a little generous so that we don't lose ties to rounding
+static double bound(double min_score) {
+	return (1.0 - min_score) / 2.5 + 1e-9;
+}
+
+int Stroke::compare(RStroke a, RStroke b, double &score, stroke_workspace_t *ws, double min_score) {
+	int match = comparable(a, b, score);
+	if (match)
+		return match;
+	double cost = stroke_compare_bounded(ws, a->get(), b->get(), bound(min_score));
+	return stroke_match(cost, a->timeout, &score);
+}
+
+void Stroke::compare_many(RStroke a, int n, const RStroke *bs, double *scores, int *matches,
+		stroke_workspace_t *ws, double min_score, bool running, const stroke_t *const *packed) {
+	std::vector<const stroke_t *> todo;
+	std::vector<int> index;
+	for (int i = 0; i < n; i++) {
+		matches[i] = comparable(a, bs[i], scores[i]);
+		if (matches[i])
+			continue;
+		todo.push_back(packed && packed[i] ? packed[i] : bs[i]->get());
+		index.push_back(i);
+	}
+	if (todo.empty())
+		return;
+	std::vector<double> costs(todo.size());
+	stroke_compare_many(ws, a->get(), &todo[0], todo.size(), &costs[0], bound(min_score),
+			running ? STROKE_BOUND_RUNNING : STROKE_BOUND_FIXED);
+	for (unsigned int k = 0; k < todo.size(); k++)
+		matches[index[k]] = stroke_match(costs[k], a->timeout, &scores[index[k]]);
 }
 
 Glib::RefPtr<Gdk::Pixbuf> Stroke::draw(int size, double width, bool inv) const {
@@ -137,7 +255,7 @@ RStroke Stroke::trefoil() {
 	for (int i = 0; i<=n; i++) {
 		double phi = M_PI*(-4.0*i/n)-2.7;
 		double r = exp(1.0 + sin(6.0*M_PI*i/n)) + 2.0;
-		s.add(create_triple(r*cos(phi), r*sin(phi), i));
+		s.add(make_triple(r*cos(phi), r*sin(phi), i));
 	}
 	return Stroke::create(s, 0, 0, AnyModifier, false);
 }
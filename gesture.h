@@ -19,6 +19,8 @@
 #include "stroke.h"
 #include <gdkmm.h>
 #include <vector>
+#include <mutex>
+#include <atomic>
 #include <boost/shared_ptr.hpp>
 #include <boost/serialization/access.hpp>
 #include <boost/serialization/version.hpp>
@@ -34,14 +36,16 @@ class PreStroke;
 typedef boost::shared_ptr<Stroke> RStroke;
 typedef boost::shared_ptr<PreStroke> RPreStroke;
 
+// A motion sample, which is passed around by value
 struct Triple {
 	float x;
 	float y;
 	Time t;
 };
-typedef boost::shared_ptr<Triple> RTriple;
-void update_triple(RTriple e, float x, float y, Time t);
-RTriple create_triple(float x, float y, Time t);
+inline Triple make_triple(float x, float y, Time t) {
+	Triple e = { x, y, t };
+	return e;
+}
 
 class PreStroke;
 class Stroke {
@@ -85,14 +89,26 @@ private:
 	BOOST_SERIALIZATION_SPLIT_MEMBER()
 	template<class Archive> void load(Archive & ar, const unsigned int version);
 	template<class Archive> void save(Archive & ar, const unsigned int version) const;
+
+	// The points as they were recorded, which are what gets saved, so that
+	// a later change of max_points can bring back the detail
+	boost::shared_ptr<stroke_t> original;
+	// The copy for matching, resampled to max_points.  Strokes that are
+	// loaded from disk are only resampled at first, and stroke_finish runs
+	// when they are first used, see prepare()
+	boost::shared_ptr<stroke_t> stroke;
+	mutable std::mutex prepare_mutex;
+	mutable std::atomic<bool> finished;
+	// Take over the points of a stroke that hasn't been finished
+	void set_points(stroke_t *s);
 public:
 	int trigger;
 	int button;
 	unsigned int modifiers;
 	bool timeout;
-	boost::shared_ptr<stroke_t> stroke;
 
-	Stroke() : trigger(0), button(0), modifiers(AnyModifier), timeout(false) {}
+	Stroke() : finished(true), trigger(0), button(0), modifiers(AnyModifier), timeout(false) {}
+	Stroke(const Stroke &s);
 	static RStroke create(PreStroke &s, int trigger_, int button_, unsigned int modifiers_, bool timeout_) {
 		return RStroke(new Stroke(s, trigger_, button_, modifiers_, timeout_));
 	}
@@ -102,23 +118,51 @@ public:
 	bool show_icon();
 
 	static RStroke trefoil();
-	static int compare(RStroke, RStroke, double &);
+	// The original points in the encoding of stroke_encode, nothing if
+	// there are none
+	void encode(std::vector<unsigned char> &data) const;
+	// A stroke whose points are read from the encoding in data, to be
+	// finished on first use.  Throws if data isn't a valid encoding.
+	static RStroke decode(const unsigned char *data, size_t size, int trigger, int button,
+			unsigned int modifiers, bool timeout);
+	// Comparisons that can't score above min_score may be cut short and
+	// reported as a mismatch
+	static int compare(RStroke, RStroke, double &, stroke_workspace_t *ws = nullptr, double min_score = 0.0);
+	// Compare a against each of the n strokes bs like compare does.  If
+	// running, min_score rises to the best score found so far.  packed may
+	// hold copies of the strokes of bs made by stroke_pack.
+	static void compare_many(RStroke a, int n, const RStroke *bs, double *scores, int *matches,
+			stroke_workspace_t *ws = nullptr, double min_score = 0.0, bool running = false,
+			const stroke_t *const *packed = nullptr);
 	static Glib::RefPtr<Gdk::Pixbuf> drawEmpty(int);
 	static Glib::RefPtr<Gdk::Pixbuf> drawDebug(RStroke, RStroke, int);
 
+	// Finish the stroke if that hasn't happened yet.  Any thread may call
+	// this, and the stroke is finished only once.
+	void prepare() const;
+	bool ready() const { return finished.load(std::memory_order_acquire); }
+	// The finished stroke for the matcher, NULL if there are no points
+	const stroke_t *get() const { prepare(); return stroke.get(); }
+
 	unsigned int size() const { return stroke ? stroke_get_size(stroke.get()) : 0; }
 	bool trivial() const { return size() == 0 && button == 0; }
-	Point points(int n) const { Point p; stroke_get_point(stroke.get(), n, &p.x, &p.y); return p; }
-	double time(int n) const { return stroke_get_time(stroke.get(), n); }
+	Point points(int n) const { Point p; stroke_get_point(get(), n, &p.x, &p.y); return p; }
+	double time(int n) const { return stroke_get_time(get(), n); }
 	bool is_timeout() const { return timeout; }
 };
-BOOST_CLASS_VERSION(Stroke, 5)
+BOOST_CLASS_VERSION(Stroke, 6)
 BOOST_CLASS_VERSION(Stroke::Point, 1)
 
-class PreStroke : public std::vector<RTriple> {
+// The samples of a stroke as it is being drawn.  The buffers of finished
+// strokes are kept and handed to the next ones, so that motion events don't
+// allocate once a few strokes have been drawn.  Main thread only.
+class PreStroke : public std::vector<Triple> {
+	static std::vector<std::vector<Triple> > spare;
 public:
+	PreStroke();
+	~PreStroke();
 	static RPreStroke create() { return RPreStroke(new PreStroke()); }
-	void add(RTriple p) { push_back(p); }
+	void add(const Triple &p) { push_back(p); }
 	bool valid() const { return size() > 2; }
 };
 #endif
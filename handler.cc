@@ -272,7 +272,7 @@ void XState::handle_xi2_event(XIDeviceEvent *event) {
 			}
 			xinput_pressed.insert(event->detail);
 			in_proximity = get_axis(event->valuators, current_dev->proximity_axis);
-			H->press(event->detail, create_triple(event->root_x, event->root_y, event->time));
+			H->press(event->detail, make_triple(event->root_x, event->root_y, event->time));
 			break;
 		case XI_ButtonRelease:
 			if (verbosity >= 3)
@@ -281,14 +281,14 @@ void XState::handle_xi2_event(XIDeviceEvent *event) {
 				break;
 			xinput_pressed.erase(event->detail);
 			in_proximity = get_axis(event->valuators, current_dev->proximity_axis);
-			H->release(event->detail, create_triple(event->root_x, event->root_y, event->time));
+			H->release(event->detail, make_triple(event->root_x, event->root_y, event->time));
 			break;
 		case XI_Motion:
 			if (verbosity >= 5)
 				report_xi2_event(event, "Motion");
 			if (!current_dev || current_dev->dev != event->deviceid)
 				break;
-			H->motion(create_triple(event->root_x, event->root_y, event->time));
+			H->motion(make_triple(event->root_x, event->root_y, event->time));
 			break;
 		case XI_RawMotion:
 			in_proximity = get_axis(((XIRawEvent *)event)->valuators, current_dev->proximity_axis);
@@ -324,7 +324,7 @@ void XState::handle_raw_motion(XIRawEvent *event) {
 		printf(") at t = %ld\n", event->time);
 	}
 
-	H->raw_motion(create_triple(x * current_dev->scale_x, y * current_dev->scale_y, event->time), abs_x, abs_y);
+	H->raw_motion(make_triple(x * current_dev->scale_x, y * current_dev->scale_y, event->time), abs_x, abs_y);
 }
 
 #undef H
@@ -394,21 +394,21 @@ class IgnoreHandler : public Handler {
 	bool proximity;
 public:
 	IgnoreHandler(RModifiers mods_) : mods(mods_), proximity(xstate->in_proximity && prefs.proximity.get()) {}
-	virtual void press(guint b, RTriple e) {
+	virtual void press(guint b, const Triple &e) {
 		if (xstate->current_dev->master) {
-			XTestFakeMotionEvent(dpy, DefaultScreen(dpy), e->x, e->y, 0);
+			XTestFakeMotionEvent(dpy, DefaultScreen(dpy), e.x, e.y, 0);
 			XTestFakeButtonEvent(dpy, b, true, CurrentTime);
 		}
 	}
-	virtual void motion(RTriple e) {
+	virtual void motion(const Triple &e) {
 		if (xstate->current_dev->master)
-			XTestFakeMotionEvent(dpy, DefaultScreen(dpy), e->x, e->y, 0);
+			XTestFakeMotionEvent(dpy, DefaultScreen(dpy), e.x, e.y, 0);
 		if (proximity && !xstate->in_proximity)
 			parent->replace_child(nullptr);
 	}
-	virtual void release(guint b, RTriple e) {
+	virtual void release(guint b, const Triple &e) {
 		if (xstate->current_dev->master) {
-			XTestFakeMotionEvent(dpy, DefaultScreen(dpy), e->x, e->y, 0);
+			XTestFakeMotionEvent(dpy, DefaultScreen(dpy), e.x, e.y, 0);
 			XTestFakeButtonEvent(dpy, b, false, CurrentTime);
 		}
 		if (proximity ? !xstate->in_proximity : !xstate->xinput_pressed.size())
@@ -429,27 +429,27 @@ public:
 		real_button(0),
 		proximity(xstate->in_proximity && prefs.proximity.get())
 	{}
-	virtual void press(guint b, RTriple e) {
+	virtual void press(guint b, const Triple &e) {
 		if (xstate->current_dev->master) {
 			if (!real_button)
 				real_button = b;
 			if (real_button == b)
 				b = button;
-			XTestFakeMotionEvent(dpy, DefaultScreen(dpy), e->x, e->y, 0);
+			XTestFakeMotionEvent(dpy, DefaultScreen(dpy), e.x, e.y, 0);
 			XTestFakeButtonEvent(dpy, b, true, CurrentTime);
 		}
 	}
-	virtual void motion(RTriple e) {
+	virtual void motion(const Triple &e) {
 		if (xstate->current_dev->master)
-			XTestFakeMotionEvent(dpy, DefaultScreen(dpy), e->x, e->y, 0);
+			XTestFakeMotionEvent(dpy, DefaultScreen(dpy), e.x, e.y, 0);
 		if (proximity && !xstate->in_proximity)
 			parent->replace_child(nullptr);
 	}
-	virtual void release(guint b, RTriple e) {
+	virtual void release(guint b, const Triple &e) {
 		if (xstate->current_dev->master) {
 			if (real_button == b)
 				b = button;
-			XTestFakeMotionEvent(dpy, DefaultScreen(dpy), e->x, e->y, 0);
+			XTestFakeMotionEvent(dpy, DefaultScreen(dpy), e.x, e.y, 0);
 			XTestFakeButtonEvent(dpy, b, false, CurrentTime);
 		}
 		if (proximity ? !xstate->in_proximity : !xstate->xinput_pressed.size())
@@ -568,30 +568,30 @@ protected:
 		XTestFakeMotionEvent(dpy, DefaultScreen(dpy), orig_x, orig_y, 0);
 	}
 public:
-	virtual void raw_motion(RTriple e, bool abs_x, bool abs_y) {
-		float dx = abs_x ? (have_x ? e->x - last_x : 0) : e->x;
-		float dy = abs_y ? (have_y ? e->y - last_y : 0) : e->y;
+	virtual void raw_motion(const Triple &e, bool abs_x, bool abs_y) {
+		float dx = abs_x ? (have_x ? e.x - last_x : 0) : e.x;
+		float dy = abs_y ? (have_y ? e.y - last_y : 0) : e.y;
 
 		if (abs_x) {
-			last_x = e->x;
+			last_x = e.x;
 			have_x = true;
 		}
 
 		if (abs_y) {
-			last_y = e->y;
+			last_y = e.y;
 			have_y = true;
 		}
 
 		if (!last_t) {
-			last_t = e->t;
+			last_t = e.t;
 			return;
 		}
 
-		if (e->t == last_t)
+		if (e.t == last_t)
 			return;
 
-		int dt = e->t - last_t;
-		last_t = e->t;
+		int dt = e.t - last_t;
+		last_t = e.t;
 
 		double factor = (prefs.scroll_invert.get() ? 1.0 : -1.0) * prefs.scroll_speed.get();
 		offset_x += factor * curve(dx/dt)*dt/20.0;
@@ -631,7 +631,7 @@ public:
 	ScrollHandler(RModifiers mods_) : mods(mods_) {
 		proximity = xstate->in_proximity && prefs.proximity.get();
 	}
-	virtual void raw_motion(RTriple e, bool abs_x, bool abs_y) {
+	virtual void raw_motion(const Triple &e, bool abs_x, bool abs_y) {
 		if (proximity && !xstate->in_proximity) {
 			parent->replace_child(nullptr);
 			move_back();
@@ -642,7 +642,7 @@ public:
 	virtual void press_master(guint b, Time t) {
 		xstate->fake_core_button(b, false);
 	}
-	virtual void release(guint b, RTriple e) {
+	virtual void release(guint b, const Triple &e) {
 		if ((proximity && xstate->in_proximity) || xstate->xinput_pressed.size())
 			return;
 		parent->replace_child(0);
@@ -661,13 +661,13 @@ public:
 		AbstractScrollHandler::fake_wheel(b1, n1, b2, n2);
 		rb = 0;
 	}
-	virtual void release(guint b, RTriple e) {
+	virtual void release(guint b, const Triple &e) {
 		Handler *p = parent;
 		p->replace_child(nullptr);
 		p->release(b, e);
 		move_back();
 	}
-	virtual void press(guint b, RTriple e) {
+	virtual void press(guint b, const Triple &e) {
 		Handler *p = parent;
 		p->replace_child(nullptr);
 		p->press(b, e);
@@ -680,14 +680,14 @@ public:
 class AdvancedStrokeActionHandler : public Handler {
 	RStroke s;
 public:
-	AdvancedStrokeActionHandler(RStroke s_, RTriple e) : s(s_) {}
-	virtual void press(guint b, RTriple e) {
+	AdvancedStrokeActionHandler(RStroke s_, const Triple &e) : s(s_) {}
+	virtual void press(guint b, const Triple &e) {
 		if (stroke_action) {
 			s->button = b;
 			(*stroke_action)(s);
 		}
 	}
-	virtual void release(guint b, RTriple e) {
+	virtual void release(guint b, const Triple &e) {
 		if (stroke_action)
 			(*stroke_action)(s);
 		if (xstate->xinput_pressed.size() == 0)
@@ -698,11 +698,11 @@ public:
 };
 
 class AdvancedHandler : public Handler {
-	RTriple e;
+	Triple e;
 	guint remap_from, remap_to;
 	Time click_time;
 	guint replay_button;
-	RTriple replay_orig;
+	Triple replay_orig;
 	std::map<guint, RAction> as;
 	std::map<guint, RRanking> rs;
 	std::map<guint, RModifiers> mods;
@@ -710,20 +710,20 @@ class AdvancedHandler : public Handler {
 	guint button1, button2;
 	RPreStroke replay;
 
-	void show_ranking(guint b, RTriple e) {
+	void show_ranking(guint b, const Triple &e) {
 		if (!rs.count(b))
 			return;
 		Ranking::queue_show(rs[b], e);
 		rs.erase(b);
 	}
-	AdvancedHandler(RStroke s, RTriple e_, guint b1, guint b2, RPreStroke replay_) :
+	AdvancedHandler(RStroke s, const Triple &e_, guint b1, guint b2, RPreStroke replay_) :
 		e(e_), remap_from(0), remap_to(0), click_time(0), replay_button(0),
 		button1(b1), button2(b2), replay(replay_) {
 			if (s)
 				actions.get_action_list(grabber->current_class->get())->handle_advanced(s, as, rs, b1, b2);
 		}
 public:
-	static Handler *create(RStroke s, RTriple e, guint b1, guint b2, RPreStroke replay) {
+	static Handler *create(RStroke s, const Triple &e, guint b1, guint b2, RPreStroke replay) {
 		if (stroke_action && s)
 			return new AdvancedStrokeActionHandler(s, e);
 		else
@@ -745,9 +745,9 @@ public:
 		}
 		replay.reset();
 	}
-	virtual void press(guint b, RTriple e) {
+	virtual void press(guint b, const Triple &e) {
 		if (xstate->current_dev->master)
-			XTestFakeMotionEvent(dpy, DefaultScreen(dpy), e->x, e->y, 0);
+			XTestFakeMotionEvent(dpy, DefaultScreen(dpy), e.x, e.y, 0);
 		click_time = 0;
 		if (remap_to) {
 			xstate->fake_core_button(remap_to, false);
@@ -765,7 +765,7 @@ public:
 		}
 		RAction act = as[bb];
 		if (IS_SCROLL(act)) {
-			click_time = e->t;
+			click_time = e.t;
 			replay_button = b;
 			replay_orig = e;
 			RModifiers m = act->prepare();
@@ -773,7 +773,7 @@ public:
 			return replace_child(new ScrollAdvancedHandler(m, replay_button));
 		}
 		if (IS_IGNORE(act)) {
-			click_time = e->t;
+			click_time = e.t;
 			replay_button = b;
 			replay_orig = e;
 		}
@@ -797,15 +797,15 @@ public:
 			sticky_mods.reset();
 		act->run();
 	}
-	virtual void motion(RTriple e) {
-		if (replay_button && hypot(replay_orig->x - e->x, replay_orig->y - e->y) > 16)
+	virtual void motion(const Triple &e) {
+		if (replay_button && hypot(replay_orig.x - e.x, replay_orig.y - e.y) > 16)
 			replay_button = 0;
 		if (xstate->current_dev->master)
-			XTestFakeMotionEvent(dpy, DefaultScreen(dpy), e->x, e->y, 0);
+			XTestFakeMotionEvent(dpy, DefaultScreen(dpy), e.x, e.y, 0);
 	}
-	virtual void release(guint b, RTriple e) {
+	virtual void release(guint b, const Triple &e) {
 		if (xstate->current_dev->master)
-			XTestFakeMotionEvent(dpy, DefaultScreen(dpy), e->x, e->y, 0);
+			XTestFakeMotionEvent(dpy, DefaultScreen(dpy), e.x, e.y, 0);
 		if (remap_to) {
 			xstate->fake_core_button(remap_to, false);
 		}
@@ -816,7 +816,7 @@ public:
 				XTestFakeButtonEvent(dpy, b, false, CurrentTime);
 		}
 		if (xstate->xinput_pressed.size() == 0) {
-			if (e->t < click_time + 250 && b == replay_button) {
+			if (e.t < click_time + 250 && b == replay_button) {
 				sticky_mods.reset();
 				mods.clear();
 				xstate->fake_click(b);
@@ -869,7 +869,7 @@ class StrokeHandler : public Handler, public sigc::trackable {
 	RPreStroke cur;
 	bool is_gesture;
 	bool drawing;
-	RTriple last, orig;
+	Triple last, orig;
 	bool use_timeout;
 	int init_timeout, final_timeout, radius;
 	struct Connection {
@@ -883,6 +883,23 @@ class StrokeHandler : public Handler, public sigc::trackable {
 	typedef boost::shared_ptr<Connection> RConnection;
 	sigc::connection init_connection;
 	std::vector<RConnection> connections;
+	// For incremental matching: the ranking of the stroke back when it
+	// had spec_size points, against the given list as it was in the given
+	// generation.  Matching runs on the main thread, so it is skipped for
+	// the rest of the stroke as soon as it would take longer than the
+	// budget.  spec_cost is the time that the last one, of any stroke, took
+	// per point and template, which is used to tell in advance.
+	sigc::connection spec_connection;
+	bool spec_idle;
+	gint64 last_motion;
+	RRanking spec;
+	unsigned int spec_size;
+	const ActionListDiff *spec_list;
+	unsigned long spec_generation;
+	bool spec_over_budget;
+	static double spec_cost; // us
+	static const gint64 spec_budget = 10000; // us
+	static const gint64 spec_rest = 20000; // us
 
 	RStroke finish(guint b) {
 		trace->end();
@@ -918,13 +935,65 @@ class StrokeHandler : public Handler, public sigc::trackable {
 		c->dist -= dist;
 		return c->dist < 0;
 	}
+
+	bool speculate() {
+		gint64 start = g_get_monotonic_time();
+		// Wait until the pointer has been at rest for long enough
+		if (!spec_idle && start < last_motion + spec_rest) {
+			spec_connection = Glib::signal_timeout().connect(sigc::mem_fun(*this, &StrokeHandler::speculate),
+					(last_motion + spec_rest - start) / 1000 + 1);
+			return false;
+		}
+		spec_connection.disconnect();
+		const ActionListDiff *list = actions.get_action_list(grabber->current_class->get());
+		unsigned int templates = std::max<unsigned int>(list->get_templates()->size(), 1);
+		double estimate = spec_cost * cur->size() * templates;
+		if (estimate > spec_budget) {
+			spec_over_budget = true;
+			if (verbosity >= 2)
+				printf("Incremental matching would take %.0f us, giving up on it for this stroke\n", estimate);
+			return false;
+		}
+		RStroke s = Stroke::create(*cur, trigger, 0, xstate->modifiers, false);
+		spec_list = list;
+		spec_generation = ActionListDiff::get_generation();
+		spec_list->rank(s, spec);
+		spec_size = cur->size();
+		gint64 elapsed = g_get_monotonic_time() - start;
+		spec_cost = (double)elapsed / (spec_size * templates);
+		if (elapsed > spec_budget) {
+			spec_over_budget = true;
+			if (verbosity >= 2)
+				printf("Incremental matching took %ld us, giving up on it for this stroke\n", (long)elapsed);
+		}
+		return false;
+	}
+
+	// Match the stroke so far as soon as we're idle whenever it has grown by
+	// an eighth, and once more when the pointer comes to rest.  A pending
+	// source is left alone unless it has to be moved up to the next idle.
+	void schedule_speculation() {
+		last_motion = g_get_monotonic_time();
+		if (spec_over_budget || cur->size() == spec_size)
+			return;
+		bool grown = cur->size() >= spec_size + spec_size/8 + 8;
+		if (spec_connection.connected() && (spec_idle || !grown))
+			return;
+		spec_connection.disconnect();
+		spec_idle = grown;
+		if (grown)
+			spec_connection = Glib::signal_idle().connect(sigc::mem_fun(*this, &StrokeHandler::speculate));
+		else
+			spec_connection = Glib::signal_timeout().connect(sigc::mem_fun(*this, &StrokeHandler::speculate),
+					spec_rest / 1000);
+	}
 protected:
 	void abort_stroke() {
 		parent->replace_child(AdvancedHandler::create(RStroke(), last, button, 0, cur));
 	}
-	virtual void motion(RTriple e) {
+	virtual void motion(const Triple &e) {
 		cur->add(e);
-		float dist = hypot(e->x-orig->x, e->y-orig->y);
+		float dist = hypot(e.x-orig.x, e.y-orig.y);
 		if (!is_gesture && dist > 16) {
 			if (use_timeout && !final_timeout)
 				return abort_stroke();
@@ -936,8 +1005,8 @@ protected:
 			bool first = true;
 			for (PreStroke::iterator i = cur->begin(); i != cur->end(); i++) {
 				Trace::Point p;
-				p.x = (*i)->x;
-				p.y = (*i)->y;
+				p.x = i->x;
+				p.y = i->y;
 				if (first) {
 					trace->start(p);
 					first = false;
@@ -947,38 +1016,50 @@ protected:
 			}
 		} else if (drawing) {
 			Trace::Point p;
-			p.x = e->x;
-			p.y = e->y;
+			p.x = e.x;
+			p.y = e.y;
 			trace->draw(p);
 		}
 		if (use_timeout && is_gesture) {
 			connections.erase(remove_if(connections.begin(), connections.end(),
 						sigc::bind(sigc::mem_fun(*this, &StrokeHandler::expired),
-							hypot(e->x - last->x, e->y - last->y))), connections.end());
+							hypot(e.x - last.x, e.y - last.y))), connections.end());
 			connections.push_back(RConnection(new Connection(this, radius, final_timeout)));
 		}
 		last = e;
+		if (is_gesture && prefs.incremental_matching.get())
+			schedule_speculation();
 	}
 
-	virtual void press(guint b, RTriple e) {
+	virtual void press(guint b, const Triple &e) {
 		RStroke s = finish(b);
 		parent->replace_child(AdvancedHandler::create(s, e, button, b, cur));
 	}
 
-	virtual void release(guint b, RTriple e) {
+	virtual void release(guint b, const Triple &e) {
 		RStroke s = finish(0);
 
 		if (prefs.move_back.get() && !xstate->current_dev->absolute)
-			XTestFakeMotionEvent(dpy, DefaultScreen(dpy), orig->x, orig->y, 0);
+			XTestFakeMotionEvent(dpy, DefaultScreen(dpy), orig.x, orig.y, 0);
 		else
-			XTestFakeMotionEvent(dpy, DefaultScreen(dpy), e->x, e->y, 0);
+			XTestFakeMotionEvent(dpy, DefaultScreen(dpy), e.x, e.y, 0);
 
 		if (stroke_action) {
 			(*stroke_action)(s);
 			return parent->replace_child(nullptr);
 		}
 		RRanking ranking;
-		RAction act = actions.get_action_list(grabber->current_class->get())->handle(s, ranking);
+		spec_connection.disconnect();
+		const ActionListDiff *list = actions.get_action_list(grabber->current_class->get());
+		if (spec && spec_list == list && spec_generation == ActionListDiff::get_generation() &&
+				spec_size == cur->size() && is_gesture && !grabber->is_instant(button) &&
+				spec->stroke->modifiers == s->modifiers) {
+			if (verbosity >= 2)
+				printf("Reusing the result of incremental matching\n");
+			ranking = spec;
+			ranking->stroke = s;
+		}
+		RAction act = list->handle(s, ranking);
 		if (!IS_CLICK(act))
 			Ranking::queue_show(ranking, e);
 		if (!act) {
@@ -995,13 +1076,13 @@ protected:
 		if (IS_SCROLL(act))
 			return parent->replace_child(new ScrollHandler(mods));
 		char buf[16];
-		snprintf(buf, sizeof(buf), "%d", (int)orig->x);
+		snprintf(buf, sizeof(buf), "%d", (int)orig.x);
 		setenv("EASYSTROKE_X1", buf, 1);
-		snprintf(buf, sizeof(buf), "%d", (int)orig->y);
+		snprintf(buf, sizeof(buf), "%d", (int)orig.y);
 		setenv("EASYSTROKE_Y1", buf, 1);
-		snprintf(buf, sizeof(buf), "%d", (int)e->x);
+		snprintf(buf, sizeof(buf), "%d", (int)e.x);
 		setenv("EASYSTROKE_X2", buf, 1);
-		snprintf(buf, sizeof(buf), "%d", (int)e->y);
+		snprintf(buf, sizeof(buf), "%d", (int)e.y);
 		setenv("EASYSTROKE_Y2", buf, 1);
 		act->run();
 		unsetenv("EASYSTROKE_X1");
@@ -1011,7 +1092,7 @@ protected:
 		parent->replace_child(nullptr);
 	}
 public:
-	StrokeHandler(guint b, RTriple e) :
+	StrokeHandler(guint b, const Triple &e) :
 		button(b),
 		trigger(grabber->get_default_button() == (int)b ? 0 : b),
 		is_gesture(false),
@@ -1020,7 +1101,13 @@ public:
 		orig(e),
 		init_timeout(prefs.init_timeout.get()),
 		final_timeout(prefs.final_timeout.get()),
-		radius(16)
+		radius(16),
+		spec_idle(false),
+		last_motion(0),
+		spec_size(0),
+		spec_list(nullptr),
+		spec_generation(0),
+		spec_over_budget(false)
 	{
 		const std::map<std::string, TimeoutType> &dt = prefs.device_timeout.ref();
 		std::map<std::string, TimeoutType>::const_iterator j = dt.find(xstate->current_dev->name);
@@ -1054,14 +1141,16 @@ public:
 	virtual Grabber::State grab_mode() { return Grabber::NONE; }
 };
 
+double StrokeHandler::spec_cost = 0.0;
+
 class IdleHandler : public Handler {
 protected:
 	virtual void init() {
 		xstate->update_core_mapping();
 	}
-	virtual void press(guint b, RTriple e) {
+	virtual void press(guint b, const Triple &e) {
 		if (current_app_window.get())
-			XState::activate_window(current_app_window.get(), e->t);
+			XState::activate_window(current_app_window.get(), e.t);
 		replace_child(new StrokeHandler(b, e));
 	}
 public:
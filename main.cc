@@ -26,6 +26,8 @@
 #include "composite.h"
 #include "grabber.h"
 #include "handler.h"
+#include "saver.h"
+#include "pool.h"
 
 #include <glibmm/i18n.h>
 
@@ -43,7 +45,7 @@ extern Source<bool> disabled;
 bool experimental = false;
 int verbosity = 0;
 const char *prefs_versions[] = { "-0.5.5", "-0.4.1", "-0.4.0", "", nullptr };
-const char *actions_versions[] = { "-0.5.6", "-0.4.1", "-0.4.0", "", nullptr };
+const char *actions_versions[] = { "-0.6.1", "-0.5.6", "-0.4.1", "-0.4.0", "", nullptr };
 Source<Window> current_app_window(None);
 std::string config_dir;
 Win *win = nullptr;
@@ -483,6 +485,10 @@ void App::create_config_dir() {
 }
 
 App::~App() {
+	// The background jobs use globals, so they have to be done before the
+	// globals are destroyed
+	background.stop();
+	pool.stop();
 	if (win) {
 		delete win;
 		trace->end();
@@ -491,6 +497,7 @@ App::~App() {
 		XCloseDisplay(dpy);
 		prefs.execute_now();
 		action_watcher->execute_now();
+		saver.wait();
 	}
 }
 
@@ -0,0 +1,215 @@
+/*
+ * Copyright (c) 2009, Thomas Jaeger <ThJaeger@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "matrix.h"
+#include "pool.h"
+#include <stdio.h>
+#include <string.h>
+
+// Bump this whenever the scores that Stroke::compare computes change
+static const char *cache_header = "# easystroke score cache 2\n";
+
+ScoreCache::ScoreCache(const std::string &filename_) : filename(filename_) {
+	FILE *f = fopen(filename.c_str(), "r");
+	if (!f)
+		return;
+	char line[128];
+	if (fgets(line, sizeof(line), f) && !strcmp(line, cache_header)) {
+		unsigned long long a, b;
+		double score;
+		int match;
+		while (fscanf(f, "%llx %llx %lf %d", &a, &b, &score, &match) == 4)
+			loaded[Key(a, b)] = Entry(score, match);
+	}
+	fclose(f);
+}
+
+bool ScoreCache::find(uint64_t a, uint64_t b, double &score, int &match) {
+	std::map<Key, Entry>::iterator i = loaded.find(Key(a, b));
+	if (i == loaded.end())
+		return false;
+	score = i->second.first;
+	match = i->second.second;
+	used.insert(*i);
+	return true;
+}
+
+void ScoreCache::insert(uint64_t a, uint64_t b, double score, int match) {
+	used[Key(a, b)] = Entry(score, match);
+}
+
+void ScoreCache::save() const {
+	std::string tmp = filename + ".tmp";
+	FILE *f = fopen(tmp.c_str(), "w");
+	if (!f)
+		return;
+	fputs(cache_header, f);
+	for (std::map<Key, Entry>::const_iterator i = used.begin(); i != used.end(); i++)
+		fprintf(f, "%016llx %016llx %.17g %d\n", (unsigned long long)i->first.first,
+				(unsigned long long)i->first.second, i->second.first, i->second.second);
+	if (fclose(f) || rename(tmp.c_str(), filename.c_str()))
+		printf("Error: Couldn't save %s\n", filename.c_str());
+}
+
+// FNV-1a
+static void hash(uint64_t &h, const void *data, size_t size) {
+	const unsigned char *p = (const unsigned char *)data;
+	for (size_t i = 0; i < size; i++) {
+		h ^= p[i];
+		h *= 1099511628211ULL;
+	}
+}
+
+uint64_t ScoreCache::key(const Stroke &s) {
+	uint64_t h = 14695981039346656037ULL;
+	hash(h, &s.trigger, sizeof(s.trigger));
+	hash(h, &s.button, sizeof(s.button));
+	hash(h, &s.modifiers, sizeof(s.modifiers));
+	hash(h, &s.timeout, sizeof(s.timeout));
+	unsigned int n = s.size();
+	hash(h, &n, sizeof(n));
+	for (unsigned int i = 0; i < n; i++) {
+		double p[2];
+		stroke_get_point(s.get(), i, &p[0], &p[1]);
+		hash(h, p, sizeof(p));
+	}
+	return h;
+}
+
+ScoreMatrix::ScoreMatrix(const std::vector<RStroke> &strokes, ScoreCache &cache, int threads,
+		const std::atomic<bool> *cancel) :
+	n(strokes.size()), scores(n*n), matches(n*n), cached(0)
+{
+	std::vector<uint64_t> keys;
+	std::vector<const stroke_t *> ss;
+	for (std::vector<RStroke>::const_iterator i = strokes.begin(); i != strokes.end(); i++) {
+		keys.push_back(ScoreCache::key(**i));
+		ss.push_back((*i)->get());
+	}
+	// Only the pairs that aren't cached are compared, one row per task
+	std::vector<std::vector<int> > todo(n);
+	for (int i = 0; i < n; i++)
+		for (int j = 0; j < n; j++)
+			if (cache.find(keys[i], keys[j], scores[i*n + j], matches[i*n + j]))
+				cached++;
+			else
+				todo[i].push_back(j);
+	stroke_t **pack = stroke_pack(ss.data(), n);
+	WorkerPool workers;
+	workers.resize(threads);
+	std::vector<stroke_workspace_t *> ws;
+	for (int i = 0; i < workers.size(); i++)
+		ws.push_back(stroke_workspace_alloc());
+	workers.run(n, [&](int i, int worker) {
+		if (cancel && *cancel)
+			return;
+		int m = todo[i].size();
+		std::vector<RStroke> bs;
+		std::vector<const stroke_t *> packed;
+		std::vector<double> row_scores(m);
+		std::vector<int> row_matches(m);
+		for (std::vector<int>::iterator j = todo[i].begin(); j != todo[i].end(); j++) {
+			bs.push_back(strokes[*j]);
+			packed.push_back(pack[*j]);
+		}
+		Stroke::compare_many(strokes[i], m, bs.data(), row_scores.data(), row_matches.data(),
+				ws[worker], 0.0, false, packed.data());
+		for (int k = 0; k < m; k++) {
+			scores[i*n + todo[i][k]] = row_scores[k];
+			matches[i*n + todo[i][k]] = row_matches[k];
+		}
+	});
+	for (std::vector<stroke_workspace_t *>::iterator i = ws.begin(); i != ws.end(); i++)
+		stroke_workspace_free(*i);
+	stroke_pack_free(pack);
+	if (cancel && *cancel)
+		return;
+	for (int i = 0; i < n; i++)
+		for (std::vector<int>::iterator j = todo[i].begin(); j != todo[i].end(); j++)
+			cache.insert(keys[i], keys[*j], scores[i*n + *j], matches[i*n + *j]);
+}
+
+static void write_csv_field(FILE *f, const std::string &s) {
+	fputc('"', f);
+	for (std::string::const_iterator c = s.begin(); c != s.end(); c++) {
+		if (*c == '"')
+			fputc('"', f);
+		fputc(*c, f);
+	}
+	fputc('"', f);
+}
+
+bool ScoreMatrix::write_csv(const std::string &filename, const std::vector<std::string> &names) const {
+	FILE *f = fopen(filename.c_str(), "w");
+	if (!f)
+		return false;
+	for (int j = 0; j < n; j++) {
+		fputc(',', f);
+		write_csv_field(f, names[j]);
+	}
+	fputc('\n', f);
+	for (int i = 0; i < n; i++) {
+		write_csv_field(f, names[i]);
+		for (int j = 0; j < n; j++)
+			if (match(i, j) < 0)
+				fputc(',', f);
+			else
+				fprintf(f, ",%.4f", score(i, j));
+		fputc('\n', f);
+	}
+	return !fclose(f);
+}
+
+static void write_json_string(FILE *f, const std::string &s) {
+	fputc('"', f);
+	for (std::string::const_iterator c = s.begin(); c != s.end(); c++)
+		if (*c == '"' || *c == '\\')
+			fprintf(f, "\\%c", *c);
+		else if ((unsigned char)*c < 0x20)
+			fprintf(f, "\\u%04x", *c);
+		else
+			fputc(*c, f);
+	fputc('"', f);
+}
+
+bool ScoreMatrix::write_json(const std::string &filename, const std::vector<std::string> &names) const {
+	FILE *f = fopen(filename.c_str(), "w");
+	if (!f)
+		return false;
+	fprintf(f, "{\n  \"names\": [");
+	for (int i = 0; i < n; i++) {
+		fputs(i ? ", " : "", f);
+		write_json_string(f, names[i]);
+	}
+	fprintf(f, "],\n  \"scores\": [");
+	for (int i = 0; i < n; i++) {
+		fprintf(f, "%s\n    [", i ? "," : "");
+		for (int j = 0; j < n; j++)
+			if (match(i, j) < 0)
+				fprintf(f, "%snull", j ? ", " : "");
+			else
+				fprintf(f, "%s%.4f", j ? ", " : "", score(i, j));
+		fputc(']', f);
+	}
+	fprintf(f, "\n  ],\n  \"matches\": [");
+	for (int i = 0; i < n; i++) {
+		fprintf(f, "%s\n    [", i ? "," : "");
+		for (int j = 0; j < n; j++)
+			fprintf(f, "%s%s", j ? ", " : "", match(i, j) < 0 ? "null" : match(i, j) ? "true" : "false");
+		fputc(']', f);
+	}
+	fprintf(f, "\n  ]\n}\n");
+	return !fclose(f);
+}
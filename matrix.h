@@ -0,0 +1,64 @@
+/*
+ * Copyright (c) 2009, Thomas Jaeger <ThJaeger@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#ifndef __MATRIX_H__
+#define __MATRIX_H__
+#include "gesture.h"
+#include <map>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <stdint.h>
+
+// Scores of earlier comparisons, keyed by the content of both strokes, so
+// that pairs that haven't changed don't have to be compared again.  Only the
+// pairs that were looked up or added since loading are saved.
+class ScoreCache {
+	typedef std::pair<uint64_t, uint64_t> Key;
+	typedef std::pair<double, int> Entry;
+	std::string filename;
+	std::map<Key, Entry> loaded, used;
+public:
+	explicit ScoreCache(const std::string &filename);
+	bool find(uint64_t a, uint64_t b, double &score, int &match);
+	void insert(uint64_t a, uint64_t b, double score, int match);
+	void save() const;
+	// Everything about a stroke that Stroke::compare looks at
+	static uint64_t key(const Stroke &s);
+};
+
+// The scores of all pairs of strokes, as Stroke::compare has them.  The
+// pairs are compared on a worker pool of their own, so this can run on any
+// one thread.  Once cancel is set, the remaining pairs are skipped and the
+// matrix is of no use.
+class ScoreMatrix {
+	int n;
+	std::vector<double> scores;
+	std::vector<int> matches;
+public:
+	ScoreMatrix(const std::vector<RStroke> &strokes, ScoreCache &cache, int threads,
+			const std::atomic<bool> *cancel = nullptr);
+	int size() const { return n; }
+	double score(int i, int j) const { return scores[i*n + j]; }
+	int match(int i, int j) const { return matches[i*n + j]; }
+	// The number of pairs that came from the cache
+	int cached;
+
+	// Pairs that can't be compared at all are left empty or null
+	bool write_csv(const std::string &filename, const std::vector<std::string> &names) const;
+	bool write_json(const std::string &filename, const std::vector<std::string> &names) const;
+};
+
+#endif
@@ -0,0 +1,130 @@
+/*
+ * Copyright (c) 2012, Thomas Jaeger <ThJaeger@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "pool.h"
+
+WorkerPool pool;
+BackgroundThread background;
+
+WorkerPool::WorkerPool() : job(nullptr), tasks(0), next(0), busy(0), generation(0), quit(false) {}
+
+WorkerPool::~WorkerPool() {
+	stop();
+}
+
+void WorkerPool::stop() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		quit = true;
+	}
+	wake.notify_all();
+	for (std::vector<std::thread>::iterator i = threads.begin(); i != threads.end(); i++)
+		i->join();
+	threads.clear();
+	quit = false;
+}
+
+void WorkerPool::resize(int n) {
+	if (n < 1)
+		n = 1;
+	if (n == size())
+		return;
+	stop();
+	for (int i = 1; i < n; i++)
+		threads.push_back(std::thread(&WorkerPool::work, this, i, generation));
+}
+
+void WorkerPool::execute(int worker) {
+	for (int i; (i = next++) < tasks;)
+		(*job)(i, worker);
+}
+
+void WorkerPool::work(int worker, unsigned long seen) {
+	std::unique_lock<std::mutex> lock(mutex);
+	for (;;) {
+		wake.wait(lock, [&]{ return quit || generation != seen; });
+		if (quit)
+			return;
+		seen = generation;
+		lock.unlock();
+		execute(worker);
+		lock.lock();
+		if (!--busy)
+			done.notify_one();
+	}
+}
+
+void WorkerPool::run(int n, const std::function<void(int, int)> &f) {
+	if (threads.empty() || n <= 1) {
+		for (int i = 0; i < n; i++)
+			f(i, 0);
+		return;
+	}
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		job = &f;
+		tasks = n;
+		next = 0;
+		busy = threads.size();
+		generation++;
+	}
+	wake.notify_all();
+	execute(0);
+	std::unique_lock<std::mutex> lock(mutex);
+	done.wait(lock, [this]{ return !busy; });
+	job = nullptr;
+}
+
+BackgroundThread::BackgroundThread() : quit(false) {}
+
+BackgroundThread::~BackgroundThread() {
+	stop();
+}
+
+void BackgroundThread::stop() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		quit = true;
+		jobs.clear();
+	}
+	wake.notify_one();
+	if (thread.joinable())
+		thread.join();
+}
+
+void BackgroundThread::work() {
+	std::unique_lock<std::mutex> lock(mutex);
+	for (;;) {
+		wake.wait(lock, [this]{ return quit || !jobs.empty(); });
+		if (quit)
+			return;
+		std::function<void()> job = jobs.front();
+		jobs.pop_front();
+		lock.unlock();
+		job();
+		lock.lock();
+	}
+}
+
+void BackgroundThread::post(const std::function<void()> &job) {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		jobs.push_back(job);
+	}
+	// Started on first use, so that there is no thread before main()
+	if (!thread.joinable())
+		thread = std::thread(&BackgroundThread::work, this);
+	wake.notify_one();
+}
@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2012, Thomas Jaeger <ThJaeger@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#ifndef __POOL_H__
+#define __POOL_H__
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <deque>
+
+// A set of worker threads that run batches of independent tasks.  Batches are
+// submitted from the main thread only.
+class WorkerPool {
+	std::vector<std::thread> threads;
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::condition_variable done;
+	const std::function<void(int, int)> *job;
+	int tasks;
+	std::atomic<int> next;
+	int busy;
+	unsigned long generation;
+	bool quit;
+
+	void work(int worker, unsigned long seen);
+	void execute(int worker);
+public:
+	WorkerPool();
+	~WorkerPool();
+	// Join the threads.  The pool can still be used, on the calling thread
+	// only, until the next resize.
+	void stop();
+	// Number of threads that work on a batch, including the calling thread
+	int size() const { return threads.size() + 1; }
+	void resize(int n);
+	// Call f(task, worker) for every task in [0, n) and wait for all of them
+	// to finish.  worker is in [0, size()) and can be used to index
+	// per-thread scratch space.
+	void run(int n, const std::function<void(int, int)> &f);
+};
+
+// A thread that runs jobs one after another in the background, for work that
+// the main thread doesn't wait for.  Jobs are posted from the main thread
+// only; the ones still pending when the program exits are dropped, see
+// stop().
+class BackgroundThread {
+	std::thread thread;
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::deque<std::function<void()> > jobs;
+	bool quit;
+
+	void work();
+public:
+	BackgroundThread();
+	~BackgroundThread();
+	void post(const std::function<void()> &job);
+	// Drop the pending jobs, wait for the running one and join the thread.
+	// Called before the globals that the jobs use are destroyed.
+	void stop();
+};
+
+extern WorkerPool pool;
+extern BackgroundThread background;
+
+#endif
@@ -16,10 +16,12 @@
 #include "prefdb.h"
 #include "main.h"
 #include "win.h"
+#include "saver.h"
 #include <glibmm/i18n.h>
 
 #include <fstream>
 #include <iostream>
+#include <sstream>
 #include <boost/archive/text_oarchive.hpp>
 #include <boost/archive/text_iarchive.hpp>
 #include <boost/serialization/set.hpp>
@@ -52,7 +54,13 @@ PrefDB::PrefDB() :
 	tray_feedback(false),
 	show_osd(true),
 	move_back(false),
-	whitelist(false)
+	whitelist(false),
+	shortlist_size(0),
+	shortlist_descriptor(DescriptorSignature),
+	max_points(0),
+	match_threads(1),
+	incremental_matching(false),
+	index_templates(false)
 {}
 
 template<class Archive> void PrefDB::serialize(Archive & ar, const unsigned int version) {
@@ -135,23 +143,36 @@ template<class Archive> void PrefDB::serialize(Archive & ar, const unsigned int
 	ar & device_timeout.unsafe_ref();
 	if (version < 18) return;
 	ar & whitelist.unsafe_ref();
+	if (version < 19) return;
+	ar & shortlist_size.unsafe_ref();
+	ar & shortlist_descriptor.unsafe_ref();
+	if (version < 20) return;
+	ar & max_points.unsafe_ref();
+	if (version < 21) return;
+	ar & match_threads.unsafe_ref();
+	if (version < 22) return;
+	ar & incremental_matching.unsafe_ref();
+	if (version < 23) return;
+	ar & index_templates.unsafe_ref();
 }
 
 void PrefDB::timeout() {
 	std::string filename = config_dir+"preferences"+prefs_versions[0];
-	std::string tmp = filename + ".tmp";
-	try {
-		std::ofstream ofs(tmp.c_str());
-		boost::archive::text_oarchive oa(ofs);
+	// The preferences are small enough that their encoding serves as the
+	// copy for the saver
+	std::ostringstream oss;
+	{
+		boost::archive::text_oarchive oa(oss);
 		const PrefDB *me = this;
 		oa << *me;
-		ofs.close();
-		if (rename(tmp.c_str(), filename.c_str()))
-			throw std::runtime_error("rename() failed");
+	}
+	std::string data = oss.str();
+	saver.post([filename, data]() {
+		replace_file(filename, data.data(), data.size());
 		if (verbosity >= 2)
 			printf("Saved preferences.\n");
-	} catch (std::exception &e) {
-		printf(_("Error: Couldn't save preferences: %s.\n"), e.what());
+	}, [this](const std::string &what) {
+		printf(_("Error: Couldn't save preferences: %s.\n"), what.c_str());
 		if (!good_state)
 			return;
 		good_state = false;
@@ -159,7 +180,7 @@ void PrefDB::timeout() {
 				"Make sure that \"%2\" is a directory and that you have write access to it.  "
 				"You can change the configuration directory "
 				"using the -c or --config-dir command line options."), _("preferences"), config_dir));
-	}
+	});
 }
 
 
@@ -27,6 +27,8 @@
 
 enum TraceType { TraceDefault, TraceShape, TraceNone, TraceAnnotate, TraceFire, TraceWater };
 enum TimeoutType { TimeoutOff, TimeoutDefault, TimeoutMedium, TimeoutAggressive, TimeoutFlick, TimeoutCustom, TimeoutConservative };
+// Must match the STROKE_DESCRIPTOR_* constants in stroke.h
+enum DescriptorType { DescriptorHistogram, DescriptorSignature };
 
 class ButtonInfo {
 	friend class boost::serialization::access;
@@ -133,12 +135,18 @@ public:
 	PrefSource<bool> move_back;
 	PrefSource<std::map<std::string, TimeoutType> > device_timeout;
 	PrefSource<bool> whitelist;
+	PrefSource<int> shortlist_size;
+	PrefSource<DescriptorType> shortlist_descriptor;
+	PrefSource<int> max_points;
+	PrefSource<int> match_threads;
+	PrefSource<bool> incremental_matching;
+	PrefSource<bool> index_templates;
 
 	void init();
 	virtual void timeout();
 };
 
-BOOST_CLASS_VERSION(PrefDB, 18)
+BOOST_CLASS_VERSION(PrefDB, 23)
 
 extern PrefDB prefs;
 
@@ -185,6 +185,12 @@ const Combo<TimeoutType>::Info timeout_info_exp[] = {
 	{ TimeoutDefault, 0 }
 };
 
+const Combo<DescriptorType>::Info descriptor_info[] = {
+	{ DescriptorSignature, N_("Direction along the stroke") },
+	{ DescriptorHistogram, N_("Direction histogram") },
+	{ DescriptorSignature, 0 }
+};
+
 Source<bool> autostart_ok(true);
 
 class Autostart : public IO<bool>, private Base {
@@ -275,6 +281,13 @@ Prefs::Prefs() {
 
 	new Check(prefs.show_osd, "check_osd");
 
+	new Adjustment<int>(prefs.shortlist_size, "adjustment_shortlist_size");
+	new Combo<DescriptorType>(prefs.shortlist_descriptor, "box_shortlist_descriptor", descriptor_info);
+	new Adjustment<int>(prefs.max_points, "adjustment_max_points");
+	new Adjustment<int>(prefs.match_threads, "adjustment_match_threads");
+	new Check(prefs.incremental_matching, "check_incremental_matching");
+	new Check(prefs.index_templates, "check_index_templates");
+
 	Gtk::Button *bbutton, *add_exception, *remove_exception, *add_extra, *edit_extra, *remove_extra;
 	widgets->get_widget("button_add_exception", add_exception);
 	widgets->get_widget("button_button", bbutton);
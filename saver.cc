@@ -0,0 +1,131 @@
+/*
+ * Copyright (c) 2009, Thomas Jaeger <ThJaeger@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "saver.h"
+#include <glibmm/i18n.h>
+#include <stdexcept>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+Saver saver;
+
+Saver::Saver() : busy(false), quit(false), failed(nullptr) {}
+
+Saver::~Saver() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		quit = true;
+	}
+	wake.notify_one();
+	if (thread.joinable())
+		thread.join();
+	delete failed;
+}
+
+void Saver::work() {
+	std::unique_lock<std::mutex> lock(mutex);
+	for (;;) {
+		wake.wait(lock, [this]{ return quit || !jobs.empty(); });
+		// Pending saves are finished even when quitting
+		if (jobs.empty())
+			return;
+		Job job = jobs.front();
+		jobs.pop_front();
+		busy = true;
+		lock.unlock();
+		std::string error;
+		try {
+			job.save();
+		} catch (std::exception &e) {
+			error = e.what();
+			if (error.empty())
+				error = _("unknown error");
+		}
+		lock.lock();
+		busy = false;
+		if (!error.empty()) {
+			errors.push_back(std::make_pair(job.on_error, error));
+			if (failed)
+				failed->emit();
+		}
+		if (jobs.empty())
+			idle.notify_all();
+	}
+}
+
+void Saver::report() {
+	std::deque<std::pair<ErrorHandler, std::string> > todo;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		todo.swap(errors);
+	}
+	for (std::deque<std::pair<ErrorHandler, std::string> >::iterator i = todo.begin(); i != todo.end(); i++)
+		i->first(i->second);
+}
+
+void Saver::post(const std::function<void()> &save, const ErrorHandler &on_error) {
+	// Created on first use, on the main thread, so that the errors are
+	// reported there
+	if (!failed) {
+		failed = new Glib::Dispatcher;
+		failed->connect(sigc::mem_fun(*this, &Saver::report));
+	}
+	Job job = { save, on_error };
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		jobs.push_back(job);
+	}
+	if (!thread.joinable())
+		thread = std::thread(&Saver::work, this);
+	wake.notify_one();
+}
+
+void Saver::wait() {
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		idle.wait(lock, [this]{ return jobs.empty() && !busy; });
+	}
+	report();
+}
+
+void replace_file(const std::string &filename, const void *data, size_t size) {
+	std::string tmp = filename + ".tmp";
+	int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0)
+		throw std::runtime_error(_("open() failed"));
+	const char *p = (const char *)data;
+	while (size) {
+		ssize_t n = write(fd, p, size);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			close(fd);
+			throw std::runtime_error(_("write() failed"));
+		}
+		p += n;
+		size -= n;
+	}
+	// Otherwise the rename may reach the disk before the data does
+	if (fsync(fd)) {
+		close(fd);
+		throw std::runtime_error(_("fsync() failed"));
+	}
+	if (close(fd))
+		throw std::runtime_error(_("close() failed"));
+	if (rename(tmp.c_str(), filename.c_str()))
+		throw std::runtime_error(_("rename() failed"));
+}
@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2009, Thomas Jaeger <ThJaeger@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#ifndef __SAVER_H__
+#define __SAVER_H__
+#include <glibmm.h>
+#include <string>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+// A thread that writes files, so that a slow disk doesn't hold up the main
+// thread, which also handles input.  Saves are posted from the main thread
+// only and run one after another.  Unlike the jobs of BackgroundThread, the
+// ones still pending when the program exits are finished.
+class Saver {
+	typedef std::function<void(const std::string &)> ErrorHandler;
+	struct Job {
+		std::function<void()> save;
+		ErrorHandler on_error;
+	};
+
+	std::thread thread;
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::condition_variable idle;
+	std::deque<Job> jobs;
+	bool busy;
+	bool quit;
+	// Saves that failed, to be reported on the main thread
+	std::deque<std::pair<ErrorHandler, std::string> > errors;
+	Glib::Dispatcher *failed;
+
+	void work();
+	void report();
+public:
+	Saver();
+	~Saver();
+	// Run save on the writer thread.  If it throws, on_error is called on
+	// the main thread with the message.
+	void post(const std::function<void()> &save, const ErrorHandler &on_error);
+	// Wait for all saves posted so far and report their errors
+	void wait();
+};
+
+// Write data to a temporary file, sync it to disk and rename it to filename,
+// so that filename always holds either the old or the new data.  Throws
+// std::runtime_error on failure.
+void replace_file(const std::string &filename, const void *data, size_t size);
+
+extern Saver saver;
+
+#endif
@@ -16,17 +16,19 @@
 #include "win.h"
 #include "actiondb.h"
 #include "main.h"
+#include "matrix.h"
+#include "pool.h"
 #include <iomanip>
 #include <glibmm/i18n.h>
 #include <sys/time.h>
 
 Stats::Stats() {
-	Gtk::Button *button_matrix;
 	widgets->get_widget("button_matrix", button_matrix);
 	widgets->get_widget("treeview_recent", recent_view);
 	widgets->get_widget("treeview_ranking", ranking_view);
 
 	button_matrix->signal_clicked().connect(sigc::mem_fun(*this, &Stats::on_pdf));
+	matrix_done.connect(sigc::mem_fun(*this, &Stats::on_pdf_done));
 
 	recent_store = Gtk::ListStore::create(cols);
 	recent_view->set_model(recent_store);
@@ -120,9 +122,9 @@ public:
 	}
 };
 
-void Ranking::queue_show(RRanking r, RTriple e) {
-	r->x = (int)e->x;
-	r->y = (int)e->y;
+void Ranking::queue_show(RRanking r, const Triple &e) {
+	r->x = (int)e.x;
+	r->y = (int)e.y;
 	Glib::signal_idle().connect(sigc::bind(sigc::ptr_fun(&Ranking::show), r));
 }
 
@@ -150,7 +152,7 @@ Glib::ustring format_float(float x) {
 Glib::RefPtr<Gdk::Pixbuf> Stroke::drawDebug(RStroke a, RStroke b, int size) {
 	// TODO: This is copy'n'paste from win.cc
 	Glib::RefPtr<Gdk::Pixbuf> pb = drawEmpty_(size);
-	if (!a || !b || !a->stroke || !b->stroke)
+	if (!a || !b || !a->get() || !b->get())
 		return pb;
 	int w = size;
 	int h = size;
@@ -163,7 +165,7 @@ Glib::RefPtr<Gdk::Pixbuf> Stroke::drawDebug(RStroke a, RStroke b, int size) {
 
 	for (unsigned int s = 0; s+1 < a->size(); s++)
 		for (unsigned int t = 0; t+1 < b->size(); t++) {
-			double col = 1.0 - stroke_angle_difference(a->stroke.get(), b->stroke.get(), s, t);
+			double col = 1.0 - stroke_angle_difference(a->get(), b->get(), s, t);
 			ctx->set_source_rgba(col,col,col,1.0);
 			ctx->rectangle(a->time(s)*size, (1.0-b->time(t+1))*size,
 					(a->time(s+1)-a->time(s))*size, (b->time(t+1)-b->time(t))*size);
@@ -171,7 +173,7 @@ Glib::RefPtr<Gdk::Pixbuf> Stroke::drawDebug(RStroke a, RStroke b, int size) {
 		}
 	int path_x[a->size() + b->size()];
 	int path_y[a->size() + b->size()];
-	stroke_compare(a->stroke.get(), b->stroke.get(), path_x, path_y);
+	stroke_compare(a->get(), b->get(), path_x, path_y);
 	ctx->set_source_rgba(1,0,0,1);
 	ctx->set_line_width(2);
 	ctx->move_to(size, 0);
@@ -231,53 +233,110 @@ bool Stats::on_stroke(RRanking r) {
 	return false;
 }
 
-void Stats::on_pdf() {
+struct Stats::MatrixJob {
+	std::vector<RStroke> strokes;
+	std::vector<std::string> names;
+	Cairo::RefPtr<Cairo::PdfSurface> surface;
+	boost::shared_ptr<ScoreMatrix> matrix;
 	struct timeval tv1, tv2;
-	if (verbosity >= 1)
-		gettimeofday(&tv1, 0);
+	// Set when the window goes away before the matrix is done
+	std::atomic<bool> cancelled;
+	MatrixJob() : cancelled(false) {}
+};
+
+Stats::~Stats() {
+	if (matrix_job)
+		matrix_job->cancelled = true;
+}
+
+// The scores are computed and drawn in the background, where the PDF surface
+// is finished, too, so that nothing but the drawing of the strokes themselves
+// blocks the main loop.
+void Stats::on_pdf() {
+	if (matrix_job)
+		return;
+	MatrixJob *job = new MatrixJob;
+	matrix_job.reset(job);
+	button_matrix->set_sensitive(false);
+	gettimeofday(&job->tv1, 0);
 	const int S = 32;
 	const int B = 1;
 	std::list<RStroke> strokes;
-	actions.get_root()->all_strokes(strokes);
+	std::list<std::string> names;
+	actions.get_root()->all_strokes(strokes, &names);
+	job->strokes.assign(strokes.begin(), strokes.end());
+	job->names.assign(names.begin(), names.end());
 	const int n = strokes.size();
-	Cairo::RefPtr<Cairo::PdfSurface> surface = Cairo::PdfSurface::create("/tmp/strokes.pdf", (n+1)*S, (n+1)*S);
-	const Cairo::RefPtr<Cairo::Context> ctx = Cairo::Context::create(surface);
-	int k = 1;
-	for (std::list<RStroke>::iterator i = strokes.begin(); i != strokes.end(); i++, k++) {
-		(*i)->draw(surface, k*S+B, B, S-2*B, S-2*B);
-		(*i)->draw(surface, B, k*S+B, S-2*B, S-2*B);
-
-		ctx->set_source_rgba(0,0,0,1);
-		ctx->set_line_width(1);
-		ctx->move_to(k*S, B);
-		ctx->line_to(k*S, (n+1)*S-B);
-		ctx->move_to(B, k*S);
-		ctx->line_to((n+1)*S-B, k*S);
-		ctx->stroke();
+	job->surface = Cairo::PdfSurface::create("/tmp/strokes.pdf", (n+1)*S, (n+1)*S);
+	{
+		const Cairo::RefPtr<Cairo::Context> ctx = Cairo::Context::create(job->surface);
+		int k = 1;
+		for (std::list<RStroke>::iterator i = strokes.begin(); i != strokes.end(); i++, k++) {
+			(*i)->draw(job->surface, k*S+B, B, S-2*B, S-2*B);
+			(*i)->draw(job->surface, B, k*S+B, S-2*B, S-2*B);
 
-		int l = 1;
-		for (std::list<RStroke>::iterator j = strokes.begin(); j != strokes.end(); j++, l++) {
-			double score;
-		        int match = Stroke::compare(*i, *j, score);
-			if (match < 0)
-				continue;
-			if (match) {
-				ctx->save();
-				ctx->set_source_rgba(0,0,1,score-0.6);
-				ctx->rectangle(l*S, k*S, S, S);
-				ctx->fill();
-				ctx->restore();
-			}
-			Glib::ustring str = format_float(score);
-			Cairo::TextExtents te;
-			ctx->get_text_extents(str, te);
-			ctx->move_to(l*S+S/2 - te.x_bearing - te.width/2, k*S+S/2 - te.y_bearing - te.height/2);
-			ctx->show_text(str);
+			ctx->set_source_rgba(0,0,0,1);
+			ctx->set_line_width(1);
+			ctx->move_to(k*S, B);
+			ctx->line_to(k*S, (n+1)*S-B);
+			ctx->move_to(B, k*S);
+			ctx->line_to((n+1)*S-B, k*S);
+			ctx->stroke();
 		}
 	}
+	matrix_thread.post([this, job]() {
+		ScoreCache cache(config_dir + "matrix-cache");
+		job->matrix.reset(new ScoreMatrix(job->strokes, cache, std::thread::hardware_concurrency(), &job->cancelled));
+		if (job->cancelled)
+			return;
+		cache.save();
+		const int n = job->matrix->size();
+		{
+			const Cairo::RefPtr<Cairo::Context> ctx = Cairo::Context::create(job->surface);
+			for (int k = 1; k <= n; k++)
+				for (int l = 1; l <= n; l++) {
+					double score = job->matrix->score(k-1, l-1);
+					int match = job->matrix->match(k-1, l-1);
+					if (match < 0)
+						continue;
+					if (match) {
+						ctx->save();
+						ctx->set_source_rgba(0,0,1,score-0.6);
+						ctx->rectangle(l*S, k*S, S, S);
+						ctx->fill();
+						ctx->restore();
+					}
+					Glib::ustring str = format_float(score);
+					Cairo::TextExtents te;
+					ctx->get_text_extents(str, te);
+					ctx->move_to(l*S+S/2 - te.x_bearing - te.width/2, k*S+S/2 - te.y_bearing - te.height/2);
+					ctx->show_text(str);
+				}
+		}
+		job->surface->finish();
+		job->surface = Cairo::RefPtr<Cairo::PdfSurface>();
+		// Next to the cache rather than in /tmp, where anyone could have
+		// put a link by that name
+		std::string csv = config_dir + "strokes.csv", json = config_dir + "strokes.json";
+		if (!job->matrix->write_csv(csv, job->names))
+			printf("Error: Couldn't write %s\n", csv.c_str());
+		if (!job->matrix->write_json(json, job->names))
+			printf("Error: Couldn't write %s\n", json.c_str());
+		gettimeofday(&job->tv2, 0);
+		matrix_done.emit();
+	});
+}
+
+void Stats::on_pdf_done() {
+	boost::shared_ptr<MatrixJob> job = matrix_job;
+	matrix_job.reset();
+	button_matrix->set_sensitive(true);
 	if (verbosity >= 1) {
-		gettimeofday(&tv2, 0);
-		printf("creating table took %ld us\n", (tv2.tv_sec - tv1.tv_sec)*1000000 + tv2.tv_usec - tv1.tv_usec);
+		int n = job->matrix->size();
+		printf("creating table took %ld us, %d of %d pairs were cached\n",
+				(job->tv2.tv_sec - job->tv1.tv_sec)*1000000 + job->tv2.tv_usec - job->tv1.tv_usec,
+				job->matrix->cached, n*n);
+		printf("Wrote /tmp/strokes.pdf, %sstrokes.csv and %sstrokes.json\n", config_dir.c_str(), config_dir.c_str());
 	}
 	if (!fork()) {
 		execlp("xdg-open", "xdg-open", "/tmp/strokes.pdf", nullptr);
@@ -18,12 +18,20 @@
 
 #include "stroke.h"
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 #include <math.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 const double stroke_infinity = 0.2;
 #define EPS 0.000001
+// Bound on the slope of the reparametrization, see compare()
+#define SLOPE 2.2
+
+// Size of the descriptors computed by stroke_finish
+#define STROKE_BINS 8
+#define STROKE_SIGNATURE 16
 
 struct point {
 	double x;
@@ -37,11 +45,13 @@ struct _stroke_t {
 	int n;
 	int capacity;
 	struct point *p;
+	double histogram[STROKE_BINS];
+	double signature[STROKE_SIGNATURE];
 };
 
 stroke_t *stroke_alloc(int n) {
 	assert(n > 0);
-	stroke_t *s = malloc(sizeof(stroke_t));
+	stroke_t *s = calloc(1, sizeof(stroke_t));
 	s->n = 0;
 	s->capacity = n;
 	s->p = calloc(n, sizeof(struct point));
@@ -55,6 +65,36 @@ void stroke_add_point(stroke_t *s, double x, double y) {
 	s->n++;
 }
 
+static inline double segment_length(const stroke_t *s, int i) {
+	return hypot(s->p[i+1].x - s->p[i].x, s->p[i+1].y - s->p[i].y);
+}
+
+void stroke_resample(stroke_t *s, int n) {
+	assert(s->capacity > 0);
+	if (n < 2 || s->n <= n)
+		return;
+	double total = 0.0;
+	for (int i = 0; i < s->n - 1; i++)
+		total += segment_length(s, i);
+	stroke_t *r = stroke_alloc(n);
+	stroke_add_point(r, s->p[0].x, s->p[0].y);
+	int i = 0;
+	double pos = 0.0, len = segment_length(s, 0);
+	for (int k = 1; k < n - 1; k++) {
+		double target = total * k / (n - 1);
+		while (pos + len < target && i < s->n - 2) {
+			pos += len;
+			len = segment_length(s, ++i);
+		}
+		double f = len > 0.0 ? (target - pos) / len : 0.0;
+		stroke_add_point(r, s->p[i].x + f * (s->p[i+1].x - s->p[i].x), s->p[i].y + f * (s->p[i+1].y - s->p[i].y));
+	}
+	stroke_add_point(r, s->p[s->n-1].x, s->p[s->n-1].y);
+	free(s->p);
+	*s = *r;
+	free(r);
+}
+
 static inline double angle_difference(double alpha, double beta) {
 	double d = alpha - beta;
 	if (d < -1.0)
@@ -64,6 +104,35 @@ static inline double angle_difference(double alpha, double beta) {
 	return d;
 }
 
+double stroke_angle_difference(const stroke_t *a, const stroke_t *b, int i, int j) {
+	return fabs(angle_difference(stroke_get_angle(a, i), stroke_get_angle(b, j)));
+}
+
+// Compute two cheap summaries of the stroke's shape: a histogram of the
+// directions weighted by length, and the direction sampled at evenly spaced
+// points along the stroke.
+static void describe(stroke_t *s) {
+	int n = s->n - 1;
+	if (n < 1 || !(s->p[n].t > 0.0))
+		return;
+	for (int i = 0; i < n; i++) {
+		// Split each segment between the two nearest bins so that small
+		// changes in direction don't move the histogram around too much
+		double pos = (s->p[i].alpha + 1.0) * STROKE_BINS / 2;
+		int bin = (int)pos;
+		double frac = pos - bin;
+		s->histogram[bin % STROKE_BINS] += s->p[i].dt * (1.0 - frac);
+		s->histogram[(bin + 1) % STROKE_BINS] += s->p[i].dt * frac;
+	}
+	int i = 0;
+	for (int k = 0; k < STROKE_SIGNATURE; k++) {
+		double t = (k + 0.5) / STROKE_SIGNATURE;
+		while (i < n - 1 && (s->p[i+1].t < t || s->p[i].dt == 0.0))
+			i++;
+		s->signature[k] = s->p[i].alpha;
+	}
+}
+
 void stroke_finish(stroke_t *s) {
 	assert(s->capacity > 0);
 	s->capacity = -1;
@@ -98,6 +167,7 @@ void stroke_finish(stroke_t *s) {
 		s->p[i].alpha = atan2(s->p[i+1].y - s->p[i].y, s->p[i+1].x - s->p[i].x)/M_PI;
 	}
 
+	describe(s);
 }
 
 void stroke_free(stroke_t *s) {
@@ -106,6 +176,125 @@ void stroke_free(stroke_t *s) {
 	free(s);
 }
 
+/* The copies share a single allocation, which starts with the array of
+ * pointers and the stroke_t structures, followed by the points of one stroke
+ * after the other.
+ */
+stroke_t **stroke_pack(const stroke_t *const *strokes, int n) {
+	size_t points = 0;
+	for (int i = 0; i < n; i++)
+		if (strokes[i])
+			points += strokes[i]->n;
+	size_t size = n * (sizeof(stroke_t *) + sizeof(stroke_t)) + points * sizeof(struct point);
+	char *p = malloc(size ? size : 1);
+	stroke_t **pack = (stroke_t **)p;
+	stroke_t *copies = (stroke_t *)(p + n * sizeof(stroke_t *));
+	struct point *next = (struct point *)(copies + n);
+	for (int i = 0; i < n; i++) {
+		const stroke_t *s = strokes[i];
+		if (!s) {
+			pack[i] = NULL;
+			continue;
+		}
+		assert(s->capacity < 0);
+		stroke_t *c = copies + i;
+		*c = *s;
+		c->p = next;
+		memcpy(c->p, s->p, s->n * sizeof(struct point));
+		next += s->n;
+		pack[i] = c;
+	}
+	return pack;
+}
+
+void stroke_pack_free(stroke_t **pack) {
+	free(pack);
+}
+
+/* The encoding starts with a format byte, the number of points and the number
+ * of fractional bits.  The coordinates are either in pixels, for strokes as
+ * they were recorded, or in the unit square after stroke_finish.  They are
+ * rounded to multiples of 2^-STROKE_FRACTION_BITS and stored as the
+ * differences to the previous point, zigzag-mapped to unsigned numbers so
+ * that small negative steps stay small.  All numbers are varints with 7 bits
+ * per byte, least significant first, so a typical step takes two to four
+ * bytes per coordinate.
+ */
+#define STROKE_FORMAT 1
+#define STROKE_FRACTION_BITS 16
+#define VARINT_MAX 10
+
+static unsigned char *put_varint(unsigned char *p, uint64_t v) {
+	while (v >= 0x80) {
+		*p++ = (v & 0x7f) | 0x80;
+		v >>= 7;
+	}
+	*p++ = v;
+	return p;
+}
+
+static const unsigned char *get_varint(const unsigned char *p, const unsigned char *end, uint64_t *v) {
+	*v = 0;
+	for (int shift = 0; p < end && shift < 64; shift += 7) {
+		*v |= (uint64_t)(*p & 0x7f) << shift;
+		if (!(*p++ & 0x80))
+			return p;
+	}
+	return NULL;
+}
+
+static inline uint64_t zigzag(int64_t v) { return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63); }
+static inline int64_t unzigzag(uint64_t v) { return (int64_t)(v >> 1) ^ -(int64_t)(v & 1); }
+
+size_t stroke_encoded_size(const stroke_t *s) {
+	return 2 + VARINT_MAX + 2 * VARINT_MAX * (size_t)s->n;
+}
+
+size_t stroke_encode(const stroke_t *s, unsigned char *buf) {
+	unsigned char *p = buf;
+	*p++ = STROKE_FORMAT;
+	p = put_varint(p, s->n);
+	*p++ = STROKE_FRACTION_BITS;
+	const double scale = 1 << STROKE_FRACTION_BITS;
+	int64_t x = 0, y = 0;
+	for (int i = 0; i < s->n; i++) {
+		int64_t x2 = llround(s->p[i].x * scale);
+		int64_t y2 = llround(s->p[i].y * scale);
+		p = put_varint(p, zigzag(x2 - x));
+		p = put_varint(p, zigzag(y2 - y));
+		x = x2;
+		y = y2;
+	}
+	return p - buf;
+}
+
+stroke_t *stroke_decode(const unsigned char *buf, size_t size) {
+	const unsigned char *p = buf, *end = buf + size;
+	uint64_t n;
+	if (p == end || *p++ != STROKE_FORMAT)
+		return NULL;
+	// Every point takes at least two bytes
+	if (!(p = get_varint(p, end, &n)) || p == end || n == 0 || n > (uint64_t)(end - p) / 2)
+		return NULL;
+	int bits = *p++;
+	if (bits > 30)
+		return NULL;
+	const double scale = 1.0 / (1 << bits);
+	stroke_t *s = stroke_alloc(n);
+	int64_t x = 0, y = 0;
+	for (uint64_t i = 0; i < n; i++) {
+		uint64_t dx, dy;
+		if (!(p = get_varint(p, end, &dx)) || !(p = get_varint(p, end, &dy))) {
+			stroke_free(s);
+			return NULL;
+		}
+		x += unzigzag(dx);
+		y += unzigzag(dy);
+		stroke_add_point(s, x * scale, y * scale);
+	}
+	return s;
+}
+
 int stroke_get_size(const stroke_t *s) { return s->n; }
 
 void stroke_get_point(const stroke_t *s, int n, double *x, double *y) {
@@ -128,135 +317,190 @@ double stroke_get_angle(const stroke_t *s, int n) {
 
 inline static double sqr(double x) { return x*x; }
 
-double stroke_angle_difference(const stroke_t *a, const stroke_t *b, int i, int j) {
-	return fabs(angle_difference(stroke_get_angle(a, i), stroke_get_angle(b, j)));
+struct _stroke_workspace_t {
+	int rows;
+	size_t dist_size;
+	int path_cells;
+	int *lo;
+	int *hi;
+	int *offset;
+	void *dist;
+	int *prev_x;
+	int *prev_y;
+	// The limits of the band for each row, see prepare(), and the stroke
+	// stroke_compare_many computed them for
+	double *min_t;
+	double *max_t;
+	size_t limits_size;
+	const stroke_t *query;
+};
+
+stroke_workspace_t *stroke_workspace_alloc(void) {
+	return calloc(1, sizeof(stroke_workspace_t));
 }
 
-static inline void step(const stroke_t *a,
-			const stroke_t *b,
-			const int N,
-			double *dist,
-			int *prev_x,
-			int *prev_y,
-			const int x,
-			const int y,
-			const double tx,
-			const double ty,
-			int *k,
-			const int x2,
-			const int y2)
-{
-	double dtx = a->p[x2].t - tx;
-	double dty = b->p[y2].t - ty;
-	if (dtx >= dty * 2.2 || dty >= dtx * 2.2 || dtx < EPS || dty < EPS)
-		return;
-	(*k)++;
+void stroke_workspace_free(stroke_workspace_t *ws) {
+	if (ws) {
+		free(ws->lo);
+		free(ws->hi);
+		free(ws->offset);
+		free(ws->dist);
+		free(ws->prev_x);
+		free(ws->prev_y);
+		free(ws->min_t);
+		free(ws->max_t);
+	}
+	free(ws);
+}
 
-	double d = 0.0;
-	int i = x, j = y;
-	double next_tx = (a->p[i+1].t - tx) / dtx;
-	double next_ty = (b->p[j+1].t - ty) / dty;
-	double cur_t = 0.0;
-
-	for (;;) {
-		double ad = sqr(angle_difference(a->p[i].alpha, b->p[j].alpha));
-		double next_t = next_tx < next_ty ? next_tx : next_ty;
-		bool done = next_t >= 1.0 - EPS;
-		if (done)
-			next_t = 1.0;
-		d += (next_t - cur_t)*ad;
-		if (done)
-			break;
-		cur_t = next_t;
-		if (next_tx < next_ty)
-			next_tx = (a->p[++i+1].t - tx) / dtx;
-		else
-			next_ty = (b->p[++j+1].t - ty) / dty;
+static void workspace_reserve(stroke_workspace_t *ws, const int M) {
+	if (ws->rows < M) {
+		free(ws->lo);
+		free(ws->hi);
+		free(ws->offset);
+		free(ws->min_t);
+		free(ws->max_t);
+		ws->lo = malloc(M * sizeof(int));
+		ws->hi = malloc(M * sizeof(int));
+		ws->offset = malloc(M * sizeof(int));
+		ws->min_t = malloc(M * sizeof(double));
+		ws->max_t = malloc(M * sizeof(double));
+		ws->rows = M;
+		ws->query = NULL;
 	}
-	double new_dist = dist[x*N+y] + d * (dtx + dty);
-	if (new_dist != new_dist) abort();
+}
 
-	if (new_dist >= dist[x2*N+y2])
-		return;
+static void workspace_reserve_cells(stroke_workspace_t *ws, const size_t dist_size, const int path_cells) {
+	if (ws->dist_size < dist_size) {
+		free(ws->dist);
+		ws->dist = malloc(dist_size);
+		ws->dist_size = dist_size;
+	}
+	if (ws->path_cells < path_cells) {
+		free(ws->prev_x);
+		free(ws->prev_y);
+		ws->prev_x = malloc(path_cells * sizeof(int));
+		ws->prev_y = malloc(path_cells * sizeof(int));
+		ws->path_cells = path_cells;
+	}
+}
+
+#define real double
+#define R(name) name##_d
+#define T(s, i) ((s)->p[i].t)
+#define ALPHA(s, i) ((s)->p[i].alpha)
+#define BAND_MARGIN 1e-9
+#include "stroke_kernel.h"
+#undef real
+#undef R
+#undef T
+#undef ALPHA
+#undef BAND_MARGIN
+
+// The single precision matcher is only built for tests/stroke-precision,
+// which compares it to the double precision one
+#ifdef STROKE_PRECISION
+#define real float
+#define R(name) name##_f
+#define T(s, i) ((float)(s)->p[i].t)
+#define ALPHA(s, i) ((float)(s)->p[i].alpha)
+#define BAND_MARGIN 1e-4
+#include "stroke_kernel.h"
+#undef real
+#undef R
+#undef T
+#undef ALPHA
+#undef BAND_MARGIN
+#endif
+
+typedef double (*compare_t)(stroke_workspace_t *, const stroke_t *, const stroke_t *, int *, int *, const double);
 
-	prev_x[x2*N+y2] = x;
-	prev_y[x2*N+y2] = y;
-	dist[x2*N+y2] = new_dist;
+static double compare_with(compare_t kernel, stroke_workspace_t *ws, const stroke_t *a, const stroke_t *b, int *path_x, int *path_y, double bound) {
+	if (!(bound < stroke_infinity))
+		bound = stroke_infinity;
+	if (ws)
+		return kernel(ws, a, b, path_x, path_y, bound);
+	ws = stroke_workspace_alloc();
+	double cost = kernel(ws, a, b, path_x, path_y, bound);
+	stroke_workspace_free(ws);
+	return cost;
+}
+
+double stroke_compare_ws(stroke_workspace_t *ws, const stroke_t *a, const stroke_t *b, int *path_x, int *path_y) {
+	return compare_with(compare_d, ws, a, b, path_x, path_y, stroke_infinity);
+}
+
+double stroke_compare_bounded(stroke_workspace_t *ws, const stroke_t *a, const stroke_t *b, double bound) {
+	return compare_with(compare_d, ws, a, b, NULL, NULL, bound);
 }
 
-/* To compare two gestures, we use dynamic programming to minimize (an
- * approximation) of the integral over square of the angle difference among
- * (roughly) all reparametrizations whose slope is always between 1/2 and 2.
- */
 double stroke_compare(const stroke_t *a, const stroke_t *b, int *path_x, int *path_y) {
-	const int M = a->n;
-	const int N = b->n;
-	const int m = M - 1;
-	const int n = N - 1;
-
-	double* dist = malloc(M * N * sizeof(double));
-	int* prev_x  = malloc(M * N * sizeof(int));
-	int* prev_y  = malloc(M * N * sizeof(int));
-	for (int i = 0; i < m; i++)
-		for (int j = 0; j < n; j++)
-			dist[i*N+j] = stroke_infinity;
-	dist[M*N-1] = stroke_infinity;
-	dist[0] = 0.0;
-
-	for (int x = 0; x < m; x++) {
-		for (int y = 0; y < n; y++) {
-			if (dist[x*N+y] >= stroke_infinity)
-				continue;
-			double tx  = a->p[x].t;
-			double ty  = b->p[y].t;
-			int max_x = x;
-			int max_y = y;
-			int k = 0;
-
-			while (k < 4) {
-				if (a->p[max_x+1].t - tx > b->p[max_y+1].t - ty) {
-					max_y++;
-					if (max_y == n) {
-						step(a, b, N, dist, prev_x, prev_y, x, y, tx, ty, &k, m, n);
-						break;
-					}
-					for (int x2 = x+1; x2 <= max_x; x2++)
-						step(a, b, N, dist, prev_x, prev_y, x, y, tx, ty, &k, x2, max_y);
-				} else {
-					max_x++;
-					if (max_x == m) {
-						step(a, b, N, dist, prev_x, prev_y, x, y, tx, ty, &k, m, n);
-						break;
-					}
-					for (int y2 = y+1; y2 <= max_y; y2++)
-						step(a, b, N, dist, prev_x, prev_y, x, y, tx, ty, &k, max_x, y2);
-				}
-			}
-		}
+	return compare_with(compare_d, NULL, a, b, path_x, path_y, stroke_infinity);
+}
+
+int stroke_compare_many(stroke_workspace_t *ws, const stroke_t *a, const stroke_t *const *b, int n, double *cost, double bound, int mode) {
+	stroke_workspace_t *tmp = ws ? NULL : (ws = stroke_workspace_alloc());
+	if (!(bound < stroke_infinity))
+		bound = stroke_infinity;
+	if (a->n > 1) {
+		workspace_reserve(ws, a->n);
+		prepare_d(ws, a);
+		ws->query = a;
 	}
-	double cost = dist[M*N-1];
-	if (path_x && path_y) {
-		if (cost < stroke_infinity) {
-			int x = m;
-			int y = n;
-			int k = 0;
-			while (x || y) {
-				int old_x = x;
-				x = prev_x[x*N+y];
-				y = prev_y[old_x*N+y];
-				path_x[k] = x;
-				path_y[k] = y;
-				k++;
-			}
-		} else {
-			path_x[0] = 0;
-			path_y[0] = 0;
+	int best = -1;
+	for (int i = 0; i < n; i++) {
+		if (!b[i]) {
+			cost[i] = stroke_infinity;
+			continue;
 		}
+		cost[i] = compare_d(ws, a, b[i], NULL, NULL, bound);
+		if (cost[i] >= stroke_infinity || (best >= 0 && cost[i] >= cost[best]))
+			continue;
+		best = i;
+		// Leave some room so that ties still get an exact cost
+		if (mode == STROKE_BOUND_RUNNING && cost[i] + 1e-9 < bound)
+			bound = cost[i] + 1e-9;
 	}
+	ws->query = NULL;
+	stroke_workspace_free(tmp);
+	return best;
+}
 
-	free(prev_y);
-	free(prev_x);
-	free(dist);
+double stroke_compare_d(stroke_workspace_t *ws, const stroke_t *a, const stroke_t *b, int *path_x, int *path_y, double bound) {
+	return compare_with(compare_d, ws, a, b, path_x, path_y, bound);
+}
 
-	return cost;
+#ifdef STROKE_PRECISION
+double stroke_compare_f(stroke_workspace_t *ws, const stroke_t *a, const stroke_t *b, int *path_x, int *path_y, double bound) {
+	return compare_with(compare_f, ws, a, b, path_x, path_y, bound);
+}
+#endif
+
+int stroke_match(double cost, int timeout, double *score) {
+	*score = 0.0;
+	if (cost >= stroke_infinity)
+		return -1;
+	*score = fmax(1.0 - 2.5*cost, 0.0);
+	return *score > (timeout ? 0.85 : 0.7);
+}
+
+double stroke_match_cost(int timeout) {
+	return (1.0 - (timeout ? 0.85 : 0.7)) / 2.5;
+}
+
+double stroke_descriptor_distance(const stroke_t *a, const stroke_t *b, int type) {
+	double d = 0.0;
+	switch (type) {
+	case STROKE_DESCRIPTOR_HISTOGRAM:
+		for (int k = 0; k < STROKE_BINS; k++)
+			d += fabs(a->histogram[k] - b->histogram[k]);
+		return d;
+	case STROKE_DESCRIPTOR_SIGNATURE:
+		for (int k = 0; k < STROKE_SIGNATURE; k++)
+			d += sqr(angle_difference(a->signature[k], b->signature[k]));
+		return d / STROKE_SIGNATURE;
+	default:
+		assert(false);
+		return 0.0;
+	}
 }
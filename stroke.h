@@ -16,16 +16,23 @@
 #ifndef __STROKE_H__
 #define __STROKE_H__
 
+#include <stddef.h>
+
 #ifdef  __cplusplus
 extern "C" {
 #endif
 
 struct _stroke_t;
+struct _stroke_workspace_t;
 
 typedef struct _stroke_t stroke_t;
+typedef struct _stroke_workspace_t stroke_workspace_t;
 
 stroke_t *stroke_alloc(int n);
 void stroke_add_point(stroke_t *stroke, double x, double y);
+/* Replace the points added so far by at most n points evenly spaced along the
+ * stroke.  Must be called before stroke_finish.  n < 2 leaves it alone. */
+void stroke_resample(stroke_t *stroke, int n);
 void stroke_finish(stroke_t *stroke);
 void stroke_free(stroke_t *stroke);
 
@@ -37,6 +44,62 @@ double stroke_angle_difference(const stroke_t *a, const stroke_t *b, int i, int
 
 double stroke_compare(const stroke_t *a, const stroke_t *b, int *path_x, int *path_y);
 
+/* Map the cost of a comparison to a score between 0 and 1 and decide whether
+ * the strokes match: 1 if they do, 0 if not and -1 if the cost is
+ * stroke_infinity.  Strokes that ended in a timeout must match more closely. */
+int stroke_match(double cost, int timeout, double *score);
+/* The cost that a comparison has to stay below for stroke_match to accept. */
+double stroke_match_cost(int timeout);
+
+/* A workspace holds the scratch buffers of stroke_compare so that they can be
+ * reused across comparisons.  It grows as needed and is not thread-safe.  If
+ * path_x or path_y is NULL, only the cost is computed.  ws may be NULL. */
+stroke_workspace_t *stroke_workspace_alloc(void);
+void stroke_workspace_free(stroke_workspace_t *ws);
+double stroke_compare_ws(stroke_workspace_t *ws, const stroke_t *a, const stroke_t *b, int *path_x, int *path_y);
+
+/* Like stroke_compare_ws, but gives up as soon as it's clear that the cost is
+ * at least bound and returns stroke_infinity in that case. */
+double stroke_compare_bounded(stroke_workspace_t *ws, const stroke_t *a, const stroke_t *b, double bound);
+
+/* Compare a against each of the n strokes b[0], ..., b[n-1] and store the
+ * costs in cost, sharing the setup that only depends on a.  Comparisons are
+ * bounded by bound as in stroke_compare_bounded.  With STROKE_BOUND_RUNNING,
+ * the bound also drops to the lowest cost found so far, leaving room for
+ * ties, so only costs that are as low as all earlier ones are exact.  NULL
+ * entries of b get cost stroke_infinity.  Returns the index of the lowest
+ * cost below bound, or -1.  ws may be NULL. */
+enum { STROKE_BOUND_FIXED, STROKE_BOUND_RUNNING };
+int stroke_compare_many(stroke_workspace_t *ws, const stroke_t *a, const stroke_t *const *b, int n, double *cost, double bound, int mode);
+
+/* Copy the n finished strokes s[0], ..., s[n-1] into a single block of memory
+ * such that stroke_compare_many streams through it when comparing against
+ * the copies in order.  NULL entries stay NULL.  The copies are read-only
+ * and freed all at once by stroke_pack_free. */
+stroke_t **stroke_pack(const stroke_t *const *s, int n);
+void stroke_pack_free(stroke_t **pack);
+
+/* A compact encoding of the points of a stroke for saving it to disk, with
+ * the coordinates rounded to multiples of 1/65536.  stroke_encode writes at most
+ * stroke_encoded_size bytes to buf and returns how many it wrote.
+ * stroke_decode returns a stroke that still has to be finished, or NULL if
+ * buf doesn't hold a valid encoding. */
+size_t stroke_encoded_size(const stroke_t *stroke);
+size_t stroke_encode(const stroke_t *stroke, unsigned char *buf);
+stroke_t *stroke_decode(const unsigned char *buf, size_t size);
+
+/* Distance between small fixed-size descriptors of two finished strokes.  It
+ * is much cheaper than stroke_compare and meant for ranking candidates. */
+enum { STROKE_DESCRIPTOR_HISTOGRAM, STROKE_DESCRIPTOR_SIGNATURE };
+double stroke_descriptor_distance(const stroke_t *a, const stroke_t *b, int type);
+
+/* The generic matcher in double precision, with both a bound and a path,
+ * and with -DSTROKE_PRECISION also in single precision. */
+double stroke_compare_d(stroke_workspace_t *ws, const stroke_t *a, const stroke_t *b, int *path_x, int *path_y, double bound);
+#ifdef STROKE_PRECISION
+double stroke_compare_f(stroke_workspace_t *ws, const stroke_t *a, const stroke_t *b, int *path_x, int *path_y, double bound);
+#endif
+
 extern const double stroke_infinity;
 
 #ifdef  __cplusplus
@@ -0,0 +1,310 @@
+/*
+ * Copyright (c) 2009, Thomas Jaeger <ThJaeger@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* The matcher of stroke.c, which includes this file once for each floating
+ * point type it is built for.  Before that, it defines
+ *     real         the floating point type
+ *     R(name)      name with a suffix for the type
+ *     T(s, i)      the arc length parameter of point i of s as a real
+ *     ALPHA(s, i)  the direction of segment i of s as a real
+ *     BAND_MARGIN  how much rounding errors of real can move the band
+ */
+
+static inline real R(sqr)(real x) { return x*x; }
+
+static inline real R(angle_difference)(real alpha, real beta) {
+	real d = alpha - beta;
+	if (d < (real)-1.0)
+		d += (real)2.0;
+	else if (d > (real)1.0)
+		d -= (real)2.0;
+	return d;
+}
+
+static inline void R(step)(const stroke_t *a,
+			const stroke_t *b,
+			const int x,
+			const int y,
+			const real tx,
+			const real ty,
+			const real dist,
+			int *k,
+			int *reach,
+			real *target,
+			int *prev_x,
+			int *prev_y,
+			const int x2,
+			const int y2)
+{
+	real dtx = T(a, x2) - tx;
+	real dty = T(b, y2) - ty;
+	if (dtx >= dty * (real)SLOPE || dty >= dtx * (real)SLOPE || dtx < (real)EPS || dty < (real)EPS)
+		return;
+	(*k)++;
+	if (!target)
+		return;
+
+	// Only divide as far as the walk gets; most steps cover a segment or two
+	real d = 0.0;
+	int i = x, j = y;
+	real next_tx = (T(a, i+1) - tx) / dtx;
+	real next_ty = (T(b, j+1) - ty) / dty;
+	real cur_t = 0.0;
+
+	for (;;) {
+		real ad = R(sqr)(R(angle_difference)(ALPHA(a, i), ALPHA(b, j)));
+		real next_t = next_tx < next_ty ? next_tx : next_ty;
+		bool done = next_t >= (real)1.0 - (real)EPS;
+		if (done)
+			next_t = 1.0;
+		d += (next_t - cur_t)*ad;
+		if (done)
+			break;
+		cur_t = next_t;
+		if (next_tx < next_ty)
+			next_tx = (T(a, ++i+1) - tx) / dtx;
+		else
+			next_ty = (T(b, ++j+1) - ty) / dty;
+	}
+	real new_dist = dist + d * (dtx + dty);
+	if (new_dist != new_dist) abort();
+
+	if (new_dist >= *target)
+		return;
+
+	if (prev_x) {
+		*prev_x = x;
+		*prev_y = y;
+	}
+	*target = new_dist;
+	if (x2 > *reach)
+		*reach = x2;
+}
+
+/* Summing the slope constraint of step() along a path from (0,0) to (x,y) and
+ * from there to (m,n) shows that only cells with
+ *     t_a/SLOPE < t_b < t_a*SLOPE  and  (1-t_a)/SLOPE < 1-t_b < (1-t_a)*SLOPE
+ * can be on a path to the end.  The limits on t_b only depend on a, so
+ * stroke_compare_many computes them just once, with some room for rounding
+ * errors.
+ */
+static void R(prepare)(stroke_workspace_t *ws, const stroke_t *a) {
+	const int m = a->n - 1;
+	for (int x = 0; x < m; x++) {
+		const double tx = T(a, x);
+		ws->min_t[x] = fmax(tx / SLOPE, 1.0 - (1.0 - tx) * SLOPE) - BAND_MARGIN;
+		ws->max_t[x] = fmin(tx * SLOPE, 1.0 - (1.0 - tx) / SLOPE) + BAND_MARGIN;
+	}
+	ws->limits_size = sizeof(real);
+}
+
+/* For each row x < m, store the range of columns y < n within the limits.
+ * Both ends of the range are nondecreasing in x.  An empty row has hi < lo.
+ */
+static void R(band)(const stroke_workspace_t *ws, const int m, const stroke_t *b, int *lo, int *hi) {
+	const int n = b->n - 1;
+	int l = 0, h = 0;
+	for (int x = 0; x < m; x++) {
+		while (l < n && T(b, l) < ws->min_t[x])
+			l++;
+		while (h < n - 1 && T(b, h+1) <= ws->max_t[x])
+			h++;
+		lo[x] = l;
+		hi[x] = h;
+	}
+}
+
+/* Without a path, only the rows that steps can still reach need to be kept
+ * around, so the band is stored in a ring of rows of the same width.  Steps
+ * usually span just a few rows, but there's no hard limit, so the ring grows
+ * when a step would wrap around.
+ */
+typedef struct {
+	real *dist;
+	int width;
+	int rows;
+} R(ring_t);
+
+static inline real *R(ring_cell)(const R(ring_t) *r, const int *lo, const int x, const int y) {
+	return r->dist + (x % r->rows) * r->width + (y - lo[x]);
+}
+
+static inline void R(ring_clear)(R(ring_t) *r, const int x, const real limit) {
+	real *row = r->dist + (x % r->rows) * r->width;
+	for (int i = 0; i < r->width; i++)
+		row[i] = limit;
+}
+
+static void R(ring_grow)(stroke_workspace_t *ws, R(ring_t) *r, const int x, const int rows, const real limit) {
+	real *dist = malloc(rows * r->width * sizeof(real));
+	for (int i = x; i < x + rows; i++) {
+		real *row = dist + (i % rows) * r->width;
+		if (i < x + r->rows)
+			memcpy(row, r->dist + (i % r->rows) * r->width, r->width * sizeof(real));
+		else
+			for (int j = 0; j < r->width; j++)
+				row[j] = limit;
+	}
+	free(ws->dist);
+	ws->dist = r->dist = dist;
+	ws->dist_size = rows * r->width * sizeof(real);
+	r->rows = rows;
+}
+
+/* To compare two gestures, we use dynamic programming to minimize (an
+ * approximation) of the integral over square of the angle difference among
+ * (roughly) all reparametrizations whose slope is always between 1/2 and 2.
+ */
+/* All costs along a path are nonnegative, so a cell whose cost has reached
+ * limit can't be part of a path ending below limit.  Such cells are never
+ * stored, and as every step moves to a later row, we can give up as soon as
+ * no row after the current one holds a cell below the limit.
+ */
+static double R(compare)(stroke_workspace_t *ws, const stroke_t *a, const stroke_t *b, int *path_x, int *path_y, const double bound) {
+	const int M = a->n;
+	const int N = b->n;
+	const int m = M - 1;
+	const int n = N - 1;
+	const bool path = path_x && path_y;
+	const real limit = bound;
+
+	if (!m || !n) {
+		if (path) {
+			path_x[0] = 0;
+			path_y[0] = 0;
+		}
+		return M == 1 && N == 1 ? 0.0 : stroke_infinity;
+	}
+	workspace_reserve(ws, M);
+	int *lo = ws->lo;
+	int *hi = ws->hi;
+	int *offset = ws->offset;
+	if (ws->query != a || ws->limits_size != sizeof(real))
+		R(prepare)(ws, a);
+	R(band)(ws, m, b, lo, hi);
+
+	R(ring_t) ring = { NULL, 1, m };
+	if (path) {
+		int cells = 0;
+		for (int x = 0; x < m; x++) {
+			offset[x] = cells - lo[x];
+			if (hi[x] >= lo[x])
+				cells += hi[x] - lo[x] + 1;
+		}
+		workspace_reserve_cells(ws, cells * sizeof(real), cells);
+		real *dist = ws->dist;
+		for (int i = 0; i < cells; i++)
+			dist[i] = limit;
+	} else {
+		for (int x = 0; x < m; x++)
+			if (hi[x] - lo[x] + 1 > ring.width)
+				ring.width = hi[x] - lo[x] + 1;
+		if (ring.rows > 8)
+			ring.rows = 8;
+		workspace_reserve_cells(ws, ring.rows * ring.width * sizeof(real), 0);
+		ring.dist = ws->dist;
+		for (int x = 0; x < ring.rows; x++)
+			R(ring_clear)(&ring, x, limit);
+	}
+	real* dist = ws->dist;
+	int* prev_x = path ? ws->prev_x : NULL;
+	int* prev_y = path ? ws->prev_y : NULL;
+	real end = limit;
+	int end_x = 0, end_y = 0;
+	int reach = 0;
+	*(path ? dist + offset[0] : R(ring_cell)(&ring, lo, 0, 0)) = 0.0;
+
+#define STEP(x2, y2) do { \
+		real *target = NULL; \
+		int *px = NULL, *py = NULL; \
+		if (x2 == m && y2 == n) { \
+			target = &end; \
+			px = &end_x; \
+			py = &end_y; \
+		} else if (y2 >= lo[x2] && y2 <= hi[x2]) { \
+			if (path) { \
+				target = dist + offset[x2] + y2; \
+				px = prev_x + offset[x2] + y2; \
+				py = prev_y + offset[x2] + y2; \
+			} else { \
+				if (x2 - x >= ring.rows) \
+					R(ring_grow)(ws, &ring, x, x2 - x + 1 > 2 * ring.rows ? x2 - x + 1 : 2 * ring.rows, limit); \
+				target = R(ring_cell)(&ring, lo, x2, y2); \
+			} \
+		} \
+		R(step)(a, b, x, y, tx, ty, d, &k, &reach, target, px, py, x2, y2); \
+	} while (0)
+
+	for (int x = 0; x < m && reach >= x; x++) {
+		for (int y = lo[x]; y <= hi[x]; y++) {
+			real d = path ? dist[offset[x] + y] : *R(ring_cell)(&ring, lo, x, y);
+			if (d >= limit)
+				continue;
+			real tx  = T(a, x);
+			real ty  = T(b, y);
+			int max_x = x;
+			int max_y = y;
+			int k = 0;
+
+			while (k < 4) {
+				if (T(a, max_x+1) - tx > T(b, max_y+1) - ty) {
+					max_y++;
+					if (max_y == n) {
+						STEP(m, n);
+						break;
+					}
+					for (int x2 = x+1; x2 <= max_x; x2++)
+						STEP(x2, max_y);
+				} else {
+					max_x++;
+					if (max_x == m) {
+						STEP(m, n);
+						break;
+					}
+					for (int y2 = y+1; y2 <= max_y; y2++)
+						STEP(max_x, y2);
+				}
+			}
+		}
+		if (!path && x + ring.rows < m)
+			R(ring_clear)(&ring, x + ring.rows, limit);
+	}
+#undef STEP
+	if (end >= limit) {
+		if (path) {
+			path_x[0] = 0;
+			path_y[0] = 0;
+		}
+		return stroke_infinity;
+	}
+	if (path) {
+		int x = end_x;
+		int y = end_y;
+		int k = 0;
+		path_x[k] = x;
+		path_y[k] = y;
+		k++;
+		while (x || y) {
+			int old_x = x;
+			x = prev_x[offset[x] + y];
+			y = prev_y[offset[old_x] + y];
+			path_x[k] = x;
+			path_y[k] = y;
+			k++;
+		}
+	}
+	return end;
+}
@@ -0,0 +1,199 @@
+/*
+ * Copyright (c) 2009, Thomas Jaeger <ThJaeger@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Times the matcher on synthetic strokes and prints the results as JSON, so
+ * that runs before and after a change can be compared.  For each family of
+ * strokes and number of points, a few queries are compared against a set of
+ * templates through stroke_compare, through stroke_compare_ws with a single
+ * workspace and through stroke_compare_many on packed templates.  The first
+ * argument is the minimum time in seconds spent on each of these.
+ *
+ * Allocations are counted by wrapping malloc and friends at link time, see
+ * the Makefile.
+ */
+#define _GNU_SOURCE
+#include "stroke.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+
+static long allocations = 0;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size) {
+	allocations++;
+	return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size) {
+	allocations++;
+	return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+	allocations++;
+	return __real_realloc(ptr, size);
+}
+
+#define QUERIES 4
+#define TEMPLATES 16
+#define MAX_POINTS 512
+
+static double rnd(void) { return rand() / (double)RAND_MAX; }
+
+static stroke_t *make(const double *x, const double *y, int n) {
+	stroke_t *s = stroke_alloc(n);
+	for (int i = 0; i < n; i++)
+		stroke_add_point(s, x[i], y[i]);
+	stroke_finish(s);
+	return s;
+}
+
+// The curve of Stroke::trefoil, rotated and distorted a little
+static stroke_t *trefoil(int n) {
+	double x[MAX_POINTS], y[MAX_POINTS];
+	double rot = (rnd() - 0.5) * 0.5, amp = 1.0 + (rnd() - 0.5) * 0.3;
+	for (int i = 0; i < n; i++) {
+		double phi = M_PI*(-4.0*i/(n-1))-2.7 + rot;
+		double r = exp(amp + sin(6.0*M_PI*i/(n-1))) + 2.0;
+		x[i] = r*cos(phi);
+		y[i] = r*sin(phi);
+	}
+	return make(x, y, n);
+}
+
+// A walk whose direction drifts randomly, so that strokes rarely match
+static stroke_t *walk(int n) {
+	double x[MAX_POINTS], y[MAX_POINTS];
+	double a = rnd() * 2 * M_PI;
+	x[0] = y[0] = 0.0;
+	for (int i = 1; i < n; i++) {
+		a += (rnd() - 0.5) * 0.8;
+		double len = 0.5 + rnd();
+		x[i] = x[i-1] + len * cos(a);
+		y[i] = y[i-1] + len * sin(a);
+	}
+	return make(x, y, n);
+}
+
+// Noisy copies of the same curve, which match each other well, so that the
+// bound rarely cuts comparisons short
+static stroke_t *near(int n) {
+	double x[MAX_POINTS], y[MAX_POINTS];
+	for (int i = 0; i < n; i++) {
+		double t = i / (double)(n - 1);
+		x[i] = sin(4.0*t) + 2.0*t + (rnd() - 0.5) * 0.02;
+		y[i] = cos(3.0*t) - t*t + (rnd() - 0.5) * 0.02;
+	}
+	return make(x, y, n);
+}
+
+static const struct {
+	const char *name;
+	stroke_t *(*make)(int n);
+} families[] = { { "trefoil", trefoil }, { "walk", walk }, { "near", near } };
+
+static const int sizes[] = { 16, 32, 64, 128, 256 };
+
+enum { MODE_COMPARE, MODE_WORKSPACE, MODE_MANY, MODES };
+static const char *modes[] = { "compare", "workspace", "many" };
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// One pass of all queries against all templates; returns the sum of the costs
+static double run(int mode, stroke_workspace_t *ws, stroke_t **qs, stroke_t **ts, stroke_t **pack) {
+	double sum = 0.0;
+	double cost[TEMPLATES];
+	for (int i = 0; i < QUERIES; i++)
+		switch (mode) {
+		case MODE_COMPARE:
+			for (int j = 0; j < TEMPLATES; j++)
+				sum += stroke_compare(qs[i], ts[j], NULL, NULL);
+			break;
+		case MODE_WORKSPACE:
+			for (int j = 0; j < TEMPLATES; j++)
+				sum += stroke_compare_ws(ws, qs[i], ts[j], NULL, NULL);
+			break;
+		case MODE_MANY:
+			stroke_compare_many(ws, qs[i], (const stroke_t *const *)pack, TEMPLATES, cost, stroke_infinity, STROKE_BOUND_FIXED);
+			for (int j = 0; j < TEMPLATES; j++)
+				sum += cost[j];
+			break;
+		}
+	return sum;
+}
+
+int main(int argc, char **argv) {
+	double min_time = argc > 1 ? atof(argv[1]) : 0.2;
+	srand(1);
+	printf("{\n");
+#if defined(__AVX__)
+	printf("  \"simd\": \"avx\",\n");
+#elif defined(__SSE2__)
+	printf("  \"simd\": \"sse2\",\n");
+#else
+	printf("  \"simd\": \"none\",\n");
+#endif
+	printf("  \"queries\": %d,\n", QUERIES);
+	printf("  \"templates\": %d,\n", TEMPLATES);
+	printf("  \"results\": [");
+	const char *sep = "\n";
+	for (unsigned int f = 0; f < sizeof(families) / sizeof(families[0]); f++)
+		for (unsigned int k = 0; k < sizeof(sizes) / sizeof(sizes[0]); k++) {
+			stroke_t *qs[QUERIES], *ts[TEMPLATES];
+			for (int i = 0; i < QUERIES; i++)
+				qs[i] = families[f].make(sizes[k]);
+			for (int j = 0; j < TEMPLATES; j++)
+				ts[j] = families[f].make(sizes[k]);
+			stroke_t **pack = stroke_pack((const stroke_t *const *)ts, TEMPLATES);
+			for (int mode = 0; mode < MODES; mode++) {
+				stroke_workspace_t *ws = stroke_workspace_alloc();
+				// Warm up, which also grows the workspace to its final size
+				double checksum = run(mode, ws, qs, ts, pack);
+				long passes = 0;
+				long allocs = allocations;
+				double t0 = now(), t;
+				do {
+					run(mode, ws, qs, ts, pack);
+					passes++;
+				} while ((t = now() - t0) < min_time);
+				allocs = allocations - allocs;
+				stroke_workspace_free(ws);
+				long cmps = passes * QUERIES * TEMPLATES;
+				printf("%s    { \"family\": \"%s\", \"points\": %d, \"mode\": \"%s\", "
+						"\"comparisons\": %ld, \"ns_per_cmp\": %.1f, \"cmp_per_s\": %.0f, "
+						"\"allocs_per_cmp\": %.2f, \"checksum\": %.9g }",
+						sep, families[f].name, sizes[k], modes[mode],
+						cmps, t / cmps * 1e9, cmps / t, (double)allocs / cmps, checksum);
+				sep = ",\n";
+			}
+			stroke_pack_free(pack);
+			for (int i = 0; i < QUERIES; i++)
+				stroke_free(qs[i]);
+			for (int j = 0; j < TEMPLATES; j++)
+				stroke_free(ts[j]);
+		}
+	printf("\n  ]\n}\n");
+	return 0;
+}
@@ -0,0 +1,458 @@
+/*
+ * Copyright (c) 2009, Thomas Jaeger <ThJaeger@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Checks the matcher against a corpus of strokes with known costs.  Every
+ * pair of the corpus is compared through each entry point of the matcher,
+ * and any cost that drifts by more than the tolerance or any decision that
+ * flips is reported as a failure.
+ *
+ *     stroke-check [-t tolerance] corpus    check the corpus
+ *     stroke-check -g                       generate a new corpus
+ *
+ * A corpus is a text file.  Lines starting with '#' are comments.
+ *     s <timeout> <x0> <y0> <x1> <y1> ...  a stroke, numbered from 0
+ *     p <i> <j> <cost> <match>             the cost of comparing stroke i
+ *                                          to stroke j and the decision
+ * Only strokes with the same timeout are compared, like in Stroke::compare.
+ * The decision is the one of stroke_match, which Stroke::compare uses too.
+ *
+ * The strokes are also resampled to a few sizes, where the costs without a
+ * path must be exactly those computed along with one.  Finally, every stroke must survive stroke_encode and
+ * stroke_decode up to rounding, both finished and in pixels, and truncated
+ * encodings must be rejected.
+ */
+#define _GNU_SOURCE
+#include "stroke.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+
+#define MAX_STROKES 1024
+#define MAX_POINTS 8192
+
+static stroke_t *strokes[MAX_STROKES];
+static int timeouts[MAX_STROKES];
+static int count = 0;
+static int generating = 0;
+
+static void add(const double *x, const double *y, int n, int timeout) {
+	if (n < 1 || count == MAX_STROKES) {
+		fprintf(stderr, "Can't add stroke %d\n", count);
+		exit(EXIT_FAILURE);
+	}
+	if (generating) {
+		printf("s %d", timeout);
+		for (int i = 0; i < n; i++)
+			printf(" %g %g", x[i], y[i]);
+		printf("\n");
+	}
+	stroke_t *s = stroke_alloc(n);
+	for (int i = 0; i < n; i++)
+		stroke_add_point(s, x[i], y[i]);
+	stroke_finish(s);
+	timeouts[count] = timeout;
+	strokes[count++] = s;
+}
+
+/* Generating the corpus */
+
+static unsigned int seed = 1;
+
+// Not rand(), so that the corpus doesn't depend on the C library
+static double rnd(void) {
+	seed = seed * 1103515245 + 12345;
+	return (seed >> 8 & 0xffffff) / (double)0x1000000;
+}
+
+// The shapes people tend to use as gestures, for u from 0 to 1
+static void shape(int k, double u, double *x, double *y) {
+	switch (k) {
+	case 0: // line
+		*x = u; *y = 0.0; break;
+	case 1: // L
+		if (u < 0.5) { *x = 0.0; *y = 2*u; } else { *x = 2*u - 1.0; *y = 1.0; }
+		break;
+	case 2: // V
+		*x = u; *y = 1.0 - fabs(2*u - 1.0); break;
+	case 3: // counterclockwise circle
+		*x = cos(2*M_PI*u); *y = -sin(2*M_PI*u); break;
+	case 4: // clockwise circle
+		*x = cos(2*M_PI*u); *y = sin(2*M_PI*u); break;
+	case 5: // Z
+		if (u < 1.0/3) { *x = 3*u; *y = 0.0; }
+		else if (u < 2.0/3) { *x = 2.0 - 3*u; *y = 3*u - 1.0; }
+		else { *x = 3*u - 2.0; *y = 1.0; }
+		break;
+	case 6: // S
+		*x = sin(2*M_PI*u) * (u < 0.5 ? -1 : 1) * 0.5; *y = u; break;
+	case 7: // trefoil, as in Stroke::trefoil
+		{
+			double phi = M_PI*(-4.0*u)-2.7;
+			double r = exp(1.0 + sin(6.0*M_PI*u)) + 2.0;
+			*x = r*cos(phi) / 10; *y = r*sin(phi) / 10;
+		}
+		break;
+	case 8: // spiral
+		*x = u * cos(6*M_PI*u); *y = u * sin(6*M_PI*u); break;
+	case 9: // zigzag
+		*x = u; *y = fabs(fmod(4*u, 1.0) - 0.5); break;
+	case 10: // N
+		if (u < 1.0/3) { *x = 0.0; *y = 1.0 - 3*u; }
+		else if (u < 2.0/3) { *x = 3*u - 1.0; *y = 3*u - 1.0; }
+		else { *x = 1.0; *y = 3.0 - 3*u; }
+		break;
+	default: // arc
+		*x = sin(M_PI*u); *y = -cos(M_PI*u); break;
+	}
+}
+
+#define SHAPES 12
+#define VARIANTS 4
+
+// Draw each shape a few times like a hand would, in pixels, at different
+// sizes, speeds and angles, and add a few strokes that are hard to handle
+static void generate_strokes(void) {
+	static double x[MAX_POINTS], y[MAX_POINTS];
+	for (int k = 0; k < SHAPES; k++)
+		for (int v = 0; v < VARIANTS; v++) {
+			int n = 12 + (int)(rnd() * 70);
+			double size = 80 + rnd() * 200;
+			double rot = (rnd() - 0.5) * 0.3;
+			double speed = 0.6 + rnd() * 0.8;
+			for (int i = 0; i < n; i++) {
+				double px, py;
+				shape(k, pow(i / (double)(n - 1), speed), &px, &py);
+				double qx = px * cos(rot) - py * sin(rot);
+				double qy = px * sin(rot) + py * cos(rot);
+				x[i] = rint(500 + size * qx + (rnd() - 0.5) * 4);
+				y[i] = rint(500 + size * qy + (rnd() - 0.5) * 4);
+			}
+			add(x, y, n, v == VARIANTS - 1);
+		}
+	// Two points
+	x[0] = 10; y[0] = 10; x[1] = 200; y[1] = 15;
+	add(x, y, 2, 0);
+	// A single point
+	add(x, y, 1, 0);
+	// Barely moving
+	x[1] = 11; y[1] = 10; x[2] = 11; y[2] = 11;
+	add(x, y, 3, 0);
+	// Pausing halfway, which repeats points
+	for (int i = 0; i < 30; i++) {
+		x[i] = 100 + 8 * (i < 10 ? i : i < 20 ? 10 : i - 10);
+		y[i] = 100 + 3 * (i < 10 ? i : i < 20 ? 10 : i - 10);
+	}
+	add(x, y, 30, 0);
+	// Many points
+	for (int i = 0; i < 400; i++) {
+		shape(7, i / 399.0, &x[i], &y[i]);
+		x[i] = rint(500 + 300 * x[i]);
+		y[i] = rint(500 + 300 * y[i]);
+	}
+	add(x, y, 400, 0);
+}
+
+static int generate(void) {
+	generating = 1;
+	printf("# Golden corpus of tests/stroke-check, generated by stroke-check -g\n");
+	generate_strokes();
+	stroke_workspace_t *ws = stroke_workspace_alloc();
+	for (int i = 0; i < count; i++)
+		for (int j = 0; j < count; j++) {
+			if (i == j || timeouts[i] != timeouts[j])
+				continue;
+			double score;
+			double cost = stroke_compare_ws(ws, strokes[i], strokes[j], NULL, NULL);
+			printf("p %d %d %.17g %d\n", i, j, cost, stroke_match(cost, timeouts[i], &score));
+		}
+	stroke_workspace_free(ws);
+	return 0;
+}
+
+/* Checking a corpus */
+
+struct pair {
+	int i;
+	int j;
+	double cost;
+	int match;
+};
+
+static struct pair *pairs = NULL;
+static int num_pairs = 0;
+
+static int load(const char *filename) {
+	FILE *f = fopen(filename, "r");
+	if (!f) {
+		perror(filename);
+		return 0;
+	}
+	static double x[MAX_POINTS], y[MAX_POINTS];
+	int size_pairs = 0;
+	char *line = NULL;
+	size_t size = 0;
+	int ok = 1;
+	for (int l = 1; getline(&line, &size, f) != -1; l++) {
+		char *p = line, *end;
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+		if (line[0] == 's') {
+			int timeout = strtol(p + 1, &p, 10);
+			int n = 0;
+			while (n < MAX_POINTS) {
+				x[n] = strtod(p, &end);
+				if (end == p)
+					break;
+				y[n] = strtod(end, &p);
+				if (p == end)
+					break;
+				n++;
+			}
+			add(x, y, n, timeout);
+		} else if (line[0] == 'p') {
+			struct pair q;
+			if (sscanf(line, "p %d %d %lf %d", &q.i, &q.j, &q.cost, &q.match) != 4 ||
+					q.i < 0 || q.i >= count || q.j < 0 || q.j >= count) {
+				fprintf(stderr, "%s:%d: invalid pair\n", filename, l);
+				ok = 0;
+				break;
+			}
+			if (num_pairs == size_pairs) {
+				size_pairs = size_pairs ? 2 * size_pairs : 1024;
+				pairs = realloc(pairs, size_pairs * sizeof(struct pair));
+			}
+			pairs[num_pairs++] = q;
+		} else {
+			fprintf(stderr, "%s:%d: invalid line\n", filename, l);
+			ok = 0;
+			break;
+		}
+	}
+	free(line);
+	fclose(f);
+	return ok;
+}
+
+static double tolerance = 1e-6;
+static int failures = 0;
+
+static void check(const struct pair *q, const char *how, double cost) {
+	double score;
+	int match = stroke_match(cost, timeouts[q->i], &score);
+	if (q->cost >= stroke_infinity ? cost >= stroke_infinity : fabs(cost - q->cost) <= tolerance) {
+		if (match == q->match)
+			return;
+	}
+	failures++;
+	printf("%s: strokes %d and %d: cost %.9f (expected %.9f), decision %d (expected %d)\n",
+			how, q->i, q->j, cost, q->cost, match, q->match);
+}
+
+// Add a copy of s with n points, spaced evenly in time
+static int resample(const stroke_t *s, int n, int timeout) {
+	static double x[MAX_POINTS], y[MAX_POINTS];
+	int m = stroke_get_size(s);
+	if (n > MAX_POINTS || count == MAX_STROKES)
+		return 0;
+	for (int i = 0, k = 0; i < n; i++) {
+		double t = i / (double)(n - 1);
+		while (k < m - 2 && stroke_get_time(s, k + 1) < t)
+			k++;
+		double t0 = stroke_get_time(s, k), t1 = stroke_get_time(s, k + 1);
+		double u = t1 > t0 ? (t - t0) / (t1 - t0) : 0.0;
+		double x0, y0, x1, y1;
+		stroke_get_point(s, k, &x0, &y0);
+		stroke_get_point(s, k + 1, &x1, &y1);
+		x[i] = x0 + u * (x1 - x0);
+		y[i] = y0 + u * (y1 - y0);
+	}
+	add(x, y, n, timeout);
+	return 1;
+}
+
+// Costs that have to be the same, not just close
+static void same(const char *how, int i, int j, double cost, double expected) {
+	if (cost == expected)
+		return;
+	failures++;
+	printf("resampled %s: strokes %d and %d: cost %.17g (expected %.17g)\n", how, i, j, cost, expected);
+}
+
+int main(int argc, char **argv) {
+	int opt;
+	while ((opt = getopt(argc, argv, "gt:")) != -1)
+		switch (opt) {
+		case 'g':
+			return generate();
+		case 't':
+			tolerance = atof(optarg);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-t tolerance] corpus | -g\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	if (optind != argc - 1) {
+		fprintf(stderr, "Usage: %s [-t tolerance] corpus | -g\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	if (!load(argv[optind]))
+		return EXIT_FAILURE;
+	stroke_workspace_t *ws = stroke_workspace_alloc();
+	static int path_x[2*MAX_POINTS], path_y[2*MAX_POINTS];
+	for (int k = 0; k < num_pairs; k++) {
+		const struct pair *q = &pairs[k];
+		const stroke_t *a = strokes[q->i], *b = strokes[q->j];
+		check(q, "stroke_compare", stroke_compare(a, b, path_x, path_y));
+		check(q, "stroke_compare_ws", stroke_compare_ws(ws, a, b, NULL, NULL));
+		// A bound just above the cost mustn't change it
+		check(q, "stroke_compare_bounded", stroke_compare_bounded(ws, a, b, q->cost + 1e-3));
+		// and one below it must cut the comparison short
+		if (q->cost < stroke_infinity && q->cost > 1e-3) {
+			struct pair r = *q;
+			r.cost = stroke_infinity;
+			r.match = -1;
+			check(&r, "stroke_compare_bounded below the cost", stroke_compare_bounded(ws, a, b, q->cost - 1e-3));
+		}
+	}
+	// Compare each stroke to all the others of its pairs in one go, with a
+	// running bound, in the order of the corpus
+	for (int k = 0; k < num_pairs;) {
+		int l = k;
+		const stroke_t *bs[MAX_STROKES];
+		double costs[MAX_STROKES];
+		for (; l < num_pairs && pairs[l].i == pairs[k].i && l - k < MAX_STROKES; l++)
+			bs[l - k] = strokes[pairs[l].j];
+		stroke_compare_many(ws, strokes[pairs[k].i], bs, l - k, costs, stroke_infinity, STROKE_BOUND_RUNNING);
+		double best = stroke_infinity;
+		for (int m = k; m < l; m++) {
+			// Costs above the best so far may be cut short
+			if (!(costs[m - k] >= stroke_infinity && pairs[m].cost > best - tolerance))
+				check(&pairs[m], "stroke_compare_many", costs[m - k]);
+			if (pairs[m].cost < best)
+				best = pairs[m].cost;
+		}
+		k = l;
+	}
+	// NULL entries, as left by stroke_pack, are skipped, and the others
+	// still match as if they were compared on their own
+	for (int k = 0; k < num_pairs;) {
+		int l = k;
+		const stroke_t *bs[2*MAX_STROKES];
+		double costs[2*MAX_STROKES];
+		for (; l < num_pairs && pairs[l].i == pairs[k].i && l - k < MAX_STROKES; l++) {
+			bs[2*(l - k)] = NULL;
+			bs[2*(l - k) + 1] = strokes[pairs[l].j];
+		}
+		stroke_t **pack = stroke_pack(bs, 2*(l - k));
+		stroke_compare_many(ws, strokes[pairs[k].i], (const stroke_t *const *)pack, 2*(l - k), costs, stroke_infinity, STROKE_BOUND_FIXED);
+		for (int m = k; m < l; m++) {
+			if (pack[2*(m - k)] || costs[2*(m - k)] != stroke_infinity) {
+				failures++;
+				printf("stroke_compare_many: pair %d: NULL entry not skipped\n", m);
+			}
+			check(&pairs[m], "stroke_compare_many with NULL entries", costs[2*(m - k) + 1]);
+		}
+		stroke_pack_free(pack);
+		k = l;
+	}
+	// Without a path, the matcher only keeps a ring of rows, which must not
+	// change the costs at all
+	int loaded = count, resampled_pairs = 0;
+	static const int sizes[] = { 16, 32, 40, 64, 120 };
+	for (unsigned int k = 0; k < sizeof(sizes) / sizeof(sizes[0]); k++) {
+		int first = count;
+		for (int i = 0; i < loaded; i++)
+			if (stroke_get_size(strokes[i]) > 1 && !resample(strokes[i], sizes[k], timeouts[i]))
+				return EXIT_FAILURE;
+		for (int i = first; i < count; i++)
+			for (int j = first; j < count; j++) {
+				if (i == j || timeouts[i] != timeouts[j])
+					continue;
+				double cost = stroke_compare(strokes[i], strokes[j], path_x, path_y);
+				same("stroke_compare_ws", i, j, stroke_compare_ws(ws, strokes[i], strokes[j], NULL, NULL), cost);
+				same("stroke_compare_bounded", i, j, stroke_compare_bounded(ws, strokes[i], strokes[j], cost + 1e-3), cost);
+				resampled_pairs++;
+			}
+	}
+	for (int i = 0; i < loaded; i++) {
+		static unsigned char buf[1 << 20];
+		size_t size = stroke_encode(strokes[i], buf);
+		if (size > stroke_encoded_size(strokes[i]) || size > sizeof(buf))
+			return EXIT_FAILURE;
+		stroke_t *s = stroke_decode(buf, size);
+		int n = stroke_get_size(strokes[i]);
+		if (!s || stroke_get_size(s) != n) {
+			failures++;
+			printf("encoding: stroke %d doesn't decode\n", i);
+		} else
+			for (int k = 0; k < n; k++) {
+				double x0, y0, x1, y1;
+				stroke_get_point(strokes[i], k, &x0, &y0);
+				stroke_get_point(s, k, &x1, &y1);
+				if (fabs(x1 - x0) > 1e-5 || fabs(y1 - y0) > 1e-5) {
+					failures++;
+					printf("encoding: stroke %d, point %d: (%g, %g) (expected (%g, %g))\n", i, k, x1, y1, x0, y0);
+					break;
+				}
+			}
+		stroke_free(s);
+		for (size_t k = 0; k < size; k++) {
+			stroke_t *t = stroke_decode(buf, k);
+			if (t) {
+				failures++;
+				printf("encoding: stroke %d decodes from %zu of %zu bytes\n", i, k, size);
+				stroke_free(t);
+				break;
+			}
+		}
+	}
+	// Strokes are saved as they were recorded, in pixels
+	for (int i = 0; i < loaded; i++) {
+		static unsigned char buf[1 << 20];
+		int n = stroke_get_size(strokes[i]);
+		stroke_t *p = stroke_alloc(n);
+		for (int k = 0; k < n; k++) {
+			double x, y;
+			stroke_get_point(strokes[i], k, &x, &y);
+			stroke_add_point(p, 2000.0 * x + 100.0, 1500.0 * y - 300.0);
+		}
+		size_t size = stroke_encode(p, buf);
+		if (size > stroke_encoded_size(p) || size > sizeof(buf))
+			return EXIT_FAILURE;
+		stroke_t *s = stroke_decode(buf, size);
+		if (!s || stroke_get_size(s) != n) {
+			failures++;
+			printf("encoding: stroke %d in pixels doesn't decode\n", i);
+		} else
+			for (int k = 0; k < n; k++) {
+				double x0, y0, x1, y1;
+				stroke_get_point(p, k, &x0, &y0);
+				stroke_get_point(s, k, &x1, &y1);
+				if (fabs(x1 - x0) > 1e-5 || fabs(y1 - y0) > 1e-5) {
+					failures++;
+					printf("encoding: stroke %d in pixels, point %d: (%g, %g) (expected (%g, %g))\n", i, k, x1, y1, x0, y0);
+					break;
+				}
+			}
+		stroke_free(s);
+		stroke_free(p);
+	}
+	stroke_workspace_free(ws);
+	printf("%d strokes, %d pairs, %d resampled pairs, %d failures\n", loaded, num_pairs, resampled_pairs, failures);
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
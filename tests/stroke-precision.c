@@ -0,0 +1,149 @@
+/*
+ * Copyright (c) 2009, Thomas Jaeger <ThJaeger@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Compares the double and single precision matchers on every pair of strokes
+ * of a corpus and reports how far the scores drift apart and whether any
+ * decision flips.  The corpus is a text file with one stroke per line, given
+ * as a list of x y coordinates.  Without one, a synthetic corpus is used.
+ */
+#define _GNU_SOURCE
+#include "stroke.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#define MAX_STROKES 4096
+#define MAX_POINTS 8192
+
+static stroke_t *strokes[MAX_STROKES];
+static int count = 0;
+
+static void add(const double *x, const double *y, int n) {
+	if (n < 2 || count == MAX_STROKES)
+		return;
+	stroke_t *s = stroke_alloc(n);
+	for (int i = 0; i < n; i++)
+		stroke_add_point(s, x[i], y[i]);
+	stroke_finish(s);
+	strokes[count++] = s;
+}
+
+static int load(const char *filename) {
+	FILE *f = fopen(filename, "r");
+	if (!f) {
+		perror(filename);
+		return 0;
+	}
+	static double x[MAX_POINTS], y[MAX_POINTS];
+	char *line = NULL;
+	size_t size = 0;
+	while (getline(&line, &size, f) != -1) {
+		if (line[0] == '#')
+			continue;
+		int n = 0;
+		char *p = line, *end;
+		while (n < MAX_POINTS) {
+			x[n] = strtod(p, &end);
+			if (end == p)
+				break;
+			y[n] = strtod(end, &p);
+			if (p == end)
+				break;
+			n++;
+		}
+		add(x, y, n);
+	}
+	free(line);
+	fclose(f);
+	return 1;
+}
+
+static double rnd(void) { return rand() / (double)RAND_MAX; }
+
+// A few families of smooth random curves, each drawn several times with
+// noise and at different sampling rates
+static void generate(int families, int variants) {
+	static double x[MAX_POINTS], y[MAX_POINTS];
+	srand(1);
+	for (int f = 0; f < families; f++) {
+		double c[8];
+		for (int i = 0; i < 8; i++)
+			c[i] = (rnd() - 0.5) * 6;
+		for (int v = 0; v < variants; v++) {
+			int n = 8 + rand() % 120;
+			double noise = rnd() * 0.05;
+			for (int i = 0; i < n; i++) {
+				double t = i / (double)(n - 1);
+				x[i] = sin(c[0]*t + c[1]) + c[2]*t + c[3]*t*t + noise * (rnd() - 0.5);
+				y[i] = cos(c[4]*t + c[5]) + c[6]*t + c[7]*t*t + noise * (rnd() - 0.5);
+			}
+			add(x, y, n);
+		}
+	}
+}
+
+static double score(double cost) {
+	double s;
+	stroke_match(cost, 0, &s);
+	return s;
+}
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char **argv) {
+	if (argc > 1) {
+		if (!load(argv[1]))
+			return 1;
+	} else {
+		generate(40, 8);
+	}
+	stroke_workspace_t *ws = stroke_workspace_alloc();
+	long pairs = 0, flips = 0, timeout_flips = 0;
+	double max_dev = 0.0, sum_dev = 0.0, time_d = 0.0, time_f = 0.0;
+	for (int i = 0; i < count; i++)
+		for (int j = i + 1; j < count; j++) {
+			double t0 = now();
+			double d = score(stroke_compare_d(ws, strokes[i], strokes[j], NULL, NULL, stroke_infinity));
+			double t1 = now();
+			double f = score(stroke_compare_f(ws, strokes[i], strokes[j], NULL, NULL, stroke_infinity));
+			double t2 = now();
+			time_d += t1 - t0;
+			time_f += t2 - t1;
+			double dev = fabs(d - f);
+			if (dev > max_dev)
+				max_dev = dev;
+			sum_dev += dev;
+			if ((d > 0.7) != (f > 0.7)) {
+				flips++;
+				printf("flip: strokes %d and %d: %.9f vs %.9f\n", i, j, d, f);
+			}
+			if ((d > 0.85) != (f > 0.85))
+				timeout_flips++;
+			pairs++;
+		}
+	stroke_workspace_free(ws);
+	printf("%d strokes, %ld pairs\n", count, pairs);
+	printf("max score deviation %.3g, mean %.3g\n", max_dev, pairs ? sum_dev / pairs : 0.0);
+	printf("decision flips: %ld at 0.7, %ld at 0.85\n", flips, timeout_flips);
+	printf("double %.2f us/cmp, float %.2f us/cmp\n", time_d / pairs * 1e6, time_f / pairs * 1e6);
+	return flips || timeout_flips;
+}
@@ -19,6 +19,7 @@
 #include <gtkmm.h>
 #include "util.h"
 #include "prefdb.h"
+#include "pool.h"
 
 class Actions;
 class Prefs;
@@ -63,11 +64,22 @@ extern Win *win;
 class Stats {
 public:
 	Stats();
+	~Stats();
 	bool on_stroke(boost::shared_ptr<Ranking>);
 private:
 	void on_pdf();
+	void on_pdf_done();
 	void on_cursor_changed();
 
+	// The matrix being computed in the background, if any
+	struct MatrixJob;
+	boost::shared_ptr<MatrixJob> matrix_job;
+	Glib::Dispatcher matrix_done;
+	Gtk::Button *button_matrix;
+	// The matrix takes a while, so it gets a thread of its own rather than
+	// holding up the jobs of the shared one.  Joined first on destruction.
+	BackgroundThread matrix_thread;
+
 	class ModelColumns : public Gtk::TreeModel::ColumnRecord {
 	public:
 		ModelColumns() { add(stroke); add(debug); add(name); add(score); add(child); }